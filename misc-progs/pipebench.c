@@ -0,0 +1,226 @@
+/*
+ * pipebench.c -- latency and throughput of a pair of pipe devices
+ *
+ *   pipebench lat dev-a dev-b [iterations]
+ *       ping-pong one byte: a child echoes what it reads from dev-a
+ *       back through dev-b; prints the mean round trip time.
+ *   pipebench bw dev [megabytes] [blocksize]
+ *       a child writes, the parent reads; prints MB/s.
+ *   pipebench mapbw dev [megabytes] [blocksize]
+ *       same, but the parent consumes in place from the mmap'ed
+ *       ring of a lockless scullpipe, with no copy on its side.
+ *
+ * Use "-" as a device to get a pipe(2) instead, as a reference.
+ * To compare the scullpipe modes, load scull with for example
+ * scull_p_lockless=0xc and run once on scullpipe0/1 and once on
+ * scullpipe2/3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+
+#include "../scull/scull.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Open a device for both ends, or make a real pipe */
+static void openpipe(const char *name, int fds[2])
+{
+	if (!strcmp(name, "-")) {
+		if (pipe(fds) < 0) {
+			perror("pipe");
+			exit(1);
+		}
+		return;
+	}
+	fds[0] = open(name, O_RDONLY);
+	fds[1] = open(name, O_WRONLY);
+	if (fds[0] < 0 || fds[1] < 0) {
+		perror(name);
+		exit(1);
+	}
+}
+
+static void fullread(int fd, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, buf, len);
+		if (n <= 0) {
+			perror("read");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void fullwrite(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n <= 0) {
+			perror("write");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static int latency(const char *a, const char *b, long iters)
+{
+	int ab[2], ba[2];
+	char c = 'x';
+	double t0, t1;
+	long i;
+
+	openpipe(a, ab);
+	openpipe(b, ba);
+	if (fork() == 0) {
+		for (i = 0; i < iters; i++) {
+			fullread(ab[0], &c, 1);
+			fullwrite(ba[1], &c, 1);
+		}
+		exit(0);
+	}
+	t0 = now();
+	for (i = 0; i < iters; i++) {
+		fullwrite(ab[1], &c, 1);
+		fullread(ba[0], &c, 1);
+	}
+	t1 = now();
+	wait(NULL);
+	printf("round trip: %.2f us (%ld iterations)\n",
+			(t1 - t0) * 1e6 / iters, iters);
+	return 0;
+}
+
+static int bandwidth(const char *name, long mb, size_t bs)
+{
+	long long total = (long long)mb << 20, left;
+	char *buf = malloc(bs);
+	int fds[2];
+	double t0, t1;
+	ssize_t n;
+
+	memset(buf, 'x', bs);
+	openpipe(name, fds);
+	if (fork() == 0) {
+		for (left = total; left > 0; left -= bs)
+			fullwrite(fds[1], buf, left < bs ? left : bs);
+		exit(0);
+	}
+	t0 = now();
+	for (left = total; left > 0; left -= n) {
+		n = read(fds[0], buf, bs);
+		if (n <= 0) {
+			perror("read");
+			exit(1);
+		}
+	}
+	t1 = now();
+	wait(NULL);
+	printf("throughput: %.1f MB/s (%ld MB, %zu-byte blocks)\n",
+			mb / (t1 - t0), mb, bs);
+	return 0;
+}
+
+static int mapbandwidth(const char *name, long mb, size_t bs)
+{
+	long long total = (long long)mb << 20, left;
+	char *buf = malloc(bs), *data;
+	struct scull_p_ring *ring;
+	unsigned int head, tail, size;
+	volatile char sink;
+	int fd, wfd;
+	double t0, t1;
+	size_t i;
+
+	memset(buf, 'x', bs);
+	fd = open(name, O_RDWR);
+	wfd = open(name, O_WRONLY);
+	if (fd < 0 || wfd < 0) {
+		perror(name);
+		exit(1);
+	}
+	ring = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) { /* just to learn the size */
+		perror("mmap");
+		exit(1);
+	}
+	size = ring->size;
+	munmap(ring, getpagesize());
+	ring = mmap(NULL, getpagesize() + ((size + getpagesize() - 1) &
+			~(getpagesize() - 1)), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	data = (char *)ring + getpagesize();
+
+	if (fork() == 0) {
+		for (left = total; left > 0; left -= bs)
+			fullwrite(wfd, buf, left < bs ? left : bs);
+		exit(0);
+	}
+	t0 = now();
+	tail = ring->tail;
+	for (left = total; left > 0; ) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		for (i = 0; i < head - tail; i += 64) /* touch it, in place */
+			sink = data[(tail + i) & (size - 1)];
+		left -= head - tail;
+		tail = head;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		ioctl(fd, SCULL_P_IOCKICK);
+	}
+	t1 = now();
+	(void)sink;
+	wait(NULL);
+	printf("throughput: %.1f MB/s (%ld MB, %zu-byte blocks, mapped reader)\n",
+			mb / (t1 - t0), mb, bs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 4 && !strcmp(argv[1], "lat"))
+		return latency(argv[2], argv[3],
+				argc > 4 ? atol(argv[4]) : 100000);
+	if (argc >= 3 && !strcmp(argv[1], "bw"))
+		return bandwidth(argv[2], argc > 3 ? atol(argv[3]) : 1024,
+				argc > 4 ? atol(argv[4]) : 65536);
+	if (argc >= 3 && !strcmp(argv[1], "mapbw"))
+		return mapbandwidth(argv[2], argc > 3 ? atol(argv[3]) : 1024,
+				argc > 4 ? atol(argv[4]) : 65536);
+	fprintf(stderr, "use: %s lat dev-a dev-b [iterations]\n"
+			"     %s bw dev [megabytes] [blocksize]\n"
+			"     %s mapbw dev [megabytes] [blocksize]\n",
+			argv[0], argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,180 @@
+/*
+ * scullaio.c -- asynchronous I/O queue depth scaling on a scull device
+ *
+ * Fills the device, then keeps 1, 2, 4, ... up to "maxqd" random
+ * block reads (or writes) in flight through the native aio system
+ * calls for a few seconds each, and prints the rate and the mean
+ * completion latency.  The device serves aio from a worker of its
+ * own, so the rate should grow with the depth until the worker is
+ * busy all the time.
+ *
+ *   scullaio [device] [size-in-MB] [maxqd] [blocksize] [seconds] [r|w]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+/* libaio is not always installed: the system calls are enough */
+static int io_setup(unsigned nr, aio_context_t *ctx)
+{
+	return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+	return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+	return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min, long max,
+		struct io_event *events)
+{
+	return syscall(__NR_io_getevents, ctx, min, max, events, NULL);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct slot {
+	struct iocb cb;
+	double start;
+};
+
+static int fd, blocksize, opcode;
+static long long nblocks;
+static unsigned int seed = 1;
+
+static void prep(struct slot *s, char *buf)
+{
+	memset(&s->cb, 0, sizeof(s->cb));
+	s->cb.aio_data = (unsigned long)s;
+	s->cb.aio_lio_opcode = opcode;
+	s->cb.aio_fildes = fd;
+	s->cb.aio_buf = (unsigned long)buf;
+	s->cb.aio_nbytes = blocksize;
+	s->cb.aio_offset = (rand_r(&seed) % nblocks) * blocksize;
+	s->start = now();
+}
+
+static void run(int qd, int seconds)
+{
+	struct slot *slots = calloc(qd, sizeof(*slots));
+	struct iocb **cbs = calloc(qd, sizeof(*cbs));
+	struct io_event *ev = calloc(qd, sizeof(*ev));
+	char *bufs = malloc((size_t)qd * blocksize);
+	aio_context_t ctx = 0;
+	long long ops = 0;
+	double lat = 0, t0, end, t;
+	int i, n;
+
+	memset(bufs, 'x', (size_t)qd * blocksize);
+	if (io_setup(qd, &ctx) < 0) {
+		perror("io_setup");
+		exit(1);
+	}
+	t0 = now();
+	end = t0 + seconds;
+	for (i = 0; i < qd; i++) {
+		prep(slots + i, bufs + (size_t)i * blocksize);
+		cbs[i] = &slots[i].cb;
+	}
+	if (io_submit(ctx, qd, cbs) != qd) {
+		perror("io_submit");
+		exit(1);
+	}
+	for (;;) {
+		n = io_getevents(ctx, 1, qd, ev);
+		if (n < 0) {
+			perror("io_getevents");
+			exit(1);
+		}
+		t = now();
+		for (i = 0; i < n; i++) {
+			struct slot *s = (struct slot *)(unsigned long)ev[i].data;
+
+			if ((long long)ev[i].res <= 0) {
+				fprintf(stderr, "aio: %s\n", strerror(-(int)ev[i].res));
+				exit(1);
+			}
+			lat += t - s->start;
+			ops++;
+			prep(s, (char *)(unsigned long)s->cb.aio_buf);
+			cbs[i] = &s->cb;
+		}
+		if (t >= end)
+			break;
+		if (io_submit(ctx, n, cbs) != n) { /* refill what completed */
+			perror("io_submit");
+			exit(1);
+		}
+	}
+	t = now() - t0;
+	io_destroy(ctx); /* waits for what is still in flight */
+	printf("%8i %14.0f %10.1f %12.1f\n", qd, ops / t,
+			ops * blocksize / t / (1 << 20), lat * 1e6 / ops);
+	free(slots);
+	free(cbs);
+	free(ev);
+	free(bufs);
+}
+
+int main(int argc, char **argv)
+{
+	char *dev = argc > 1 ? argv[1] : "/dev/scullc0";
+	long long size = (argc > 2 ? atoll(argv[2]) : 64) << 20, off;
+	int maxqd = argc > 3 ? atoi(argv[3]) : 64;
+	int seconds, qd;
+	ssize_t n;
+	char *buf;
+
+	blocksize = argc > 4 ? atoi(argv[4]) : 4000;
+	seconds = argc > 5 ? atoi(argv[5]) : 3;
+	opcode = argc > 6 && argv[6][0] == 'w' ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	buf = malloc(1 << 20);
+	memset(buf, 'x', 1 << 20);
+	/* the device may stop short at a quantum boundary */
+	for (off = 0; off < size; off += n) {
+		n = pwrite(fd, buf, size - off < 1 << 20 ? size - off : 1 << 20, off);
+		if (n <= 0) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+	free(buf);
+	nblocks = size / blocksize;
+
+	printf("%8s %14s %10s %12s\n", "qd", "ops/s", "MB/s", "lat-us");
+	for (qd = 1; qd <= maxqd; ) {
+		run(qd, seconds);
+		/* powers of two, and always the full depth last */
+		if (qd < maxqd && qd * 2 > maxqd)
+			qd = maxqd;
+		else
+			qd *= 2;
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * scullmap.c -- page fault cost and scaling of a mapped scull device
+ *
+ * Fills the device, then for 1, 2, 4, ... up to "maxthreads" threads
+ * maps all of it afresh and has each thread touch one byte per page
+ * of its own slice.  Prints how long that took and how many page
+ * faults it cost.  Faults take no device lock, so with single-page
+ * faults (scullv, sculld, or scullp loaded with scullp_fault_around=1)
+ * the rate should grow with the number of threads.  With scullp's
+ * default fault-around window a 1 GB device faults 512 times rather
+ * than once per page.
+ *
+ *   scullmap [device] [size-in-MB] [maxthreads]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+static volatile char *map;
+static long long size;
+static long pagesize;
+static int nthreads;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *toucher(void *arg)
+{
+	long id = (long)arg;
+	long long pages = size / pagesize, off, end;
+	char sink = 0;
+
+	off = pages * id / nthreads * pagesize;
+	end = pages * (id + 1) / nthreads * pagesize;
+	for (; off < end; off += pagesize)
+		sink += map[off];
+	return (void *)(long)sink;
+}
+
+int main(int argc, char **argv)
+{
+	char *dev = argc > 1 ? argv[1] : "/dev/scullp0";
+	int maxthreads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+	struct rusage r0, r1;
+	pthread_t *threads;
+	long long off;
+	long faults;
+	double t0, t1;
+	char *buf;
+	ssize_t n;
+	int fd, i;
+
+	size = (argc > 2 ? atoll(argv[2]) : 1024) << 20;
+	pagesize = getpagesize();
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	buf = malloc(1 << 20);
+	memset(buf, 'x', 1 << 20);
+	/* the device may stop short at a quantum boundary */
+	for (off = 0; off < size; off += n) {
+		n = pwrite(fd, buf, size - off < 1 << 20 ? size - off : 1 << 20, off);
+		if (n <= 0) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+	free(buf);
+
+	threads = calloc(maxthreads, sizeof(*threads));
+	printf("%lld MB, %lld pages\n", size >> 20, size / pagesize);
+	printf("%8s %10s %10s %14s\n", "threads", "ms", "faults", "faults/s");
+	for (nthreads = 1; nthreads <= maxthreads; ) {
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		getrusage(RUSAGE_SELF, &r0);
+		t0 = now();
+		for (i = 0; i < nthreads; i++)
+			pthread_create(threads + i, NULL, toucher, (void *)(long)i);
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		t1 = now();
+		getrusage(RUSAGE_SELF, &r1);
+		munmap((void *)map, size);
+
+		faults = r1.ru_minflt - r0.ru_minflt;
+		printf("%8i %10.1f %10ld %14.0f\n", nthreads, (t1 - t0) * 1e3,
+				faults, faults / (t1 - t0));
+		/* powers of two, and always the full count last */
+		if (nthreads < maxthreads && nthreads * 2 > maxthreads)
+			nthreads = maxthreads;
+		else
+			nthreads *= 2;
+	}
+	close(fd);
+	return 0;
+}
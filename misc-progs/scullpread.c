@@ -0,0 +1,106 @@
+/*
+ * scullpread.c -- parallel pread() scaling on one scull device
+ *
+ * Fills the device, then runs 1, 2, 4, ... up to "maxthreads"
+ * threads that pread() random blocks for a few seconds each, and
+ * prints the aggregate rate.  Readers only share the device lock,
+ * so the rate should grow with the number of cores.
+ *
+ *   scullpread [device] [size-in-MB] [maxthreads] [blocksize] [seconds]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static int fd, blocksize, seconds;
+static long long size;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	long long ops;
+};
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	long long nblocks = size / blocksize;
+	char *buf = malloc(blocksize);
+	long long ops = 0; /* kept local: no false sharing between workers */
+
+	while (!stop) {
+		long long blk = rand_r(&w->seed) % nblocks;
+
+		if (pread(fd, buf, blocksize, blk * blocksize) <= 0) {
+			perror("pread");
+			exit(1);
+		}
+		ops++;
+	}
+	w->ops = ops;
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	char *dev = argc > 1 ? argv[1] : "/dev/scull0";
+	int maxthreads, nthreads, i;
+	struct worker *w;
+	long long total, off;
+	char *buf;
+
+	size = (argc > 2 ? atoll(argv[2]) : 256) << 20;
+	maxthreads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+	blocksize = argc > 4 ? atoi(argv[4]) : 4000;
+	seconds = argc > 5 ? atoi(argv[5]) : 3;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	buf = malloc(1 << 20);
+	memset(buf, 'x', 1 << 20);
+	for (off = 0; off < size; off += 1 << 20)
+		if (pwrite(fd, buf, 1 << 20, off) <= 0) {
+			perror("pwrite");
+			exit(1);
+		}
+	free(buf);
+
+	w = calloc(maxthreads, sizeof(*w));
+	printf("%8s %14s %10s\n", "threads", "reads/s", "MB/s");
+	for (nthreads = 1; nthreads <= maxthreads; ) {
+		stop = 0;
+		for (i = 0; i < nthreads; i++) {
+			w[i].seed = i + 1;
+			w[i].ops = 0;
+			pthread_create(&w[i].thread, NULL, reader, w + i);
+		}
+		sleep(seconds);
+		stop = 1;
+		total = 0;
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(w[i].thread, NULL);
+			total += w[i].ops;
+		}
+		printf("%8i %14.0f %10.1f\n", nthreads, (double)total / seconds,
+				(double)total * blocksize / seconds / (1 << 20));
+		/* powers of two, and always the full count last */
+		if (nthreads < maxthreads && nthreads * 2 > maxthreads)
+			nthreads = maxthreads;
+		else
+			nthreads *= 2;
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * scullseek.c -- time random reads across a large scull device
+ *
+ * Writes one small block at evenly spaced offsets over the whole
+ * device (4 GB by default; scull keeps holes unallocated) and then
+ * times pread() at each of them.  With an indexed device the
+ * latency should stay flat from offset 0 to the end.
+ *
+ *   scullseek [device] [size-in-MB] [points] [reads-per-point]
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK 512
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	char *dev = argc > 1 ? argv[1] : "/dev/scull0";
+	long long size = (argc > 2 ? atoll(argv[2]) : 4096) << 20;
+	int points = argc > 3 ? atoi(argv[3]) : 32;
+	int reads = argc > 4 ? atoi(argv[4]) : 10000;
+	char buf[BLOCK];
+	long long off, step;
+	double t0, t1;
+	int fd, i, j;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	if (points < 2)
+		points = 2;
+	step = (size - BLOCK) / (points - 1);
+
+	/* populate the sample points; the last one sets the device size */
+	memset(buf, 'x', BLOCK);
+	for (i = 0; i < points; i++) {
+		off = i * step;
+		if (pwrite(fd, buf, BLOCK, off) <= 0) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+
+	printf("%16s %12s\n", "offset", "ns/read");
+	for (i = 0; i < points; i++) {
+		off = i * step;
+		t0 = now_ns();
+		for (j = 0; j < reads; j++)
+			if (pread(fd, buf, BLOCK, off) <= 0) {
+				perror("pread");
+				exit(1);
+			}
+		t1 = now_ns();
+		printf("%16lld %12.0f\n", off, (t1 - t0) / reads);
+	}
+	close(fd);
+	return 0;
+}
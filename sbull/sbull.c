@@ -16,11 +16,17 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/hdreg.h>	/* HDIO_GETGEO */
 #include <linux/kdev_t.h>
-#include <linux/vmalloc.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/buffer_head.h>	/* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>	/* kmap_atomic() */
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -28,8 +34,8 @@ static int sbull_major = 0;
 module_param(sbull_major, int, 0);
 static int hardsect_size = 512;
 module_param(hardsect_size, int, 0);
-static int nsectors = 1024;	/* How big the drive is */
-module_param(nsectors, int, 0);
+static unsigned long nsectors = 1024;	/* How big the drive is */
+module_param(nsectors, ulong, 0);
 static int ndevices = 4;
 module_param(ndevices, int, 0);
 
@@ -40,10 +46,35 @@ enum {
 	RM_SIMPLE  = 0,	/* The extra-simple request function */
 	RM_FULL    = 1,	/* The full-blown version */
 	RM_NOQUEUE = 2,	/* Use make_request */
+	RM_MQ      = 3,	/* Multiqueue, one hardware queue per CPU */
 };
 static int request_mode = RM_SIMPLE;
 module_param(request_mode, int, 0);
 
+/*
+ * The disk is thin: backing pages are allocated on first write.  The
+ * simple and full request functions run under the queue lock, and
+ * blk-mq may call queue_rq with preemption off, so all three can only
+ * allocate with GFP_ATOMIC: writes to new areas of the disk may fail
+ * with EIO under memory pressure.  Use the noqueue mode, which
+ * allocates with GFP_NOIO, for anything serious.
+ */
+
+static const char *sbull_mode_names[] = {
+	[RM_SIMPLE]	= "simple",
+	[RM_FULL]	= "full",
+	[RM_NOQUEUE]	= "noqueue",
+	[RM_MQ]		= "mq",
+};
+
+/*
+ * Shape of the multiqueue setup: zero hardware queues means one per CPU.
+ */
+static int hw_queues = 0;
+module_param(hw_queues, int, 0);
+static int queue_depth = 64;
+module_param(queue_depth, int, 0);
+
 /*
  * Minor number and partition management.
  */
@@ -62,62 +93,416 @@ module_param(request_mode, int, 0);
  */
 #define INVALIDATE_DELAY	30*HZ
 
+/*
+ * The data lives in pages allocated on first write, so a big disk
+ * costs only what has been written to it.  The pages are kept in
+ * radix trees, one per shard: the disk is cut into regions of
+ * 1 << SBULL_REGION_SHIFT pages dealt round-robin to the shards, so that
+ * I/O to different regions takes different locks.
+ */
+#define SBULL_SHARDS		16
+#define SBULL_REGION_SHIFT	8	/* 256 pages, 1MB with 4k pages */
+
+struct sbull_shard {
+	spinlock_t lock;		/* Protects the tree and the pages */
+	struct radix_tree_root pages;	/* Written pages, by page index */
+};
+
+/*
+ * I/O statistics, kept per CPU so that counting costs no shared
+ * cache line; they are summed only when read through debugfs.
+ * Latency is the time a request (or a bio, with make_request)
+ * spends in the driver, in log2 buckets of nanoseconds.
+ */
+#define SBULL_LAT_BUCKETS	32	/* The last one takes everything over 1s */
+
+struct sbull_stats {
+	unsigned long ios[2];		/* Completed reads and writes */
+	unsigned long sectors[2];	/* Sectors read and written */
+	unsigned long merges[2];	/* Bios merged into bigger requests */
+	unsigned long lat[SBULL_LAT_BUCKETS];
+};
+
 /*
  * The internal representation of our device.
  */
 struct sbull_dev {
-        int size;                       /* Device size in sectors */
-        u8 *data;                       /* The data array */
+        u64 size;                       /* Device size in bytes */
+        struct sbull_shard shards[SBULL_SHARDS]; /* The data pages */
         short users;                    /* How many users */
         short media_change;             /* Flag a media change? */
         spinlock_t lock;                /* For mutual exclusion */
         struct request_queue *queue;    /* The device request queue */
+        struct blk_mq_tag_set tag_set;  /* Tags for RM_MQ */
         struct gendisk *gd;             /* The gendisk structure */
         struct timer_list timer;        /* For simulated media changes */
+        struct sbull_stats __percpu *stats; /* I/O statistics */
+        struct dentry *debugfs;         /* Our debugfs directory */
 };
 
 static struct sbull_dev *Devices = NULL;
+static struct dentry *sbull_debugfs;	/* The "sbull" directory */
+
+/*
+ * Statistics.  this_cpu operations are safe from any context, so the
+ * accounting needs no lock and no preemption games.
+ */
+static void sbull_account(struct sbull_dev *dev, int write,
+		unsigned int sectors, unsigned int merges, u64 start)
+{
+	int bucket = fls64(ktime_get_ns() - start);
+
+	if (bucket >= SBULL_LAT_BUCKETS)
+		bucket = SBULL_LAT_BUCKETS - 1;
+	this_cpu_inc(dev->stats->ios[write]);
+	this_cpu_add(dev->stats->sectors[write], sectors);
+	this_cpu_add(dev->stats->merges[write], merges);
+	this_cpu_inc(dev->stats->lat[bucket]);
+}
+
+/* How many bios the block layer merged into this request */
+static unsigned int sbull_rq_merges(struct request *req)
+{
+	struct bio *bio;
+	unsigned int nbios = 0;
+
+	__rq_for_each_bio(bio, req)
+		nbios++;
+	return nbios ? nbios - 1 : 0;
+}
+
+static void sbull_sum_stats(struct sbull_dev *dev, struct sbull_stats *sum)
+{
+	struct sbull_stats *st;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		for (i = 0; i < 2; i++) {
+			sum->ios[i] += st->ios[i];
+			sum->sectors[i] += st->sectors[i];
+			sum->merges[i] += st->merges[i];
+		}
+		for (i = 0; i < SBULL_LAT_BUCKETS; i++)
+			sum->lat[i] += st->lat[i];
+	}
+}
+
+static int sbull_stats_show(struct seq_file *s, void *v)
+{
+	struct sbull_dev *dev = s->private;
+	struct sbull_stats sum;
+
+	sbull_sum_stats(dev, &sum);
+	seq_printf(s, "mode %s\n", sbull_mode_names[request_mode]);
+	seq_printf(s, "reads %lu sectors %lu merges %lu\n",
+			sum.ios[READ], sum.sectors[READ], sum.merges[READ]);
+	seq_printf(s, "writes %lu sectors %lu merges %lu\n",
+			sum.ios[WRITE], sum.sectors[WRITE], sum.merges[WRITE]);
+	return 0;
+}
+
+static int sbull_latency_show(struct seq_file *s, void *v)
+{
+	struct sbull_dev *dev = s->private;
+	struct sbull_stats sum;
+	int i;
+
+	sbull_sum_stats(dev, &sum);
+	seq_printf(s, "mode %s\n", sbull_mode_names[request_mode]);
+	for (i = 0; i < SBULL_LAT_BUCKETS; i++) {
+		if (!sum.lat[i])
+			continue;
+		if (i == SBULL_LAT_BUCKETS - 1)
+			seq_printf(s, "%12s ns %lu\n", "more", sum.lat[i]);
+		else
+			seq_printf(s, "<%11llu ns %lu\n", 1ULL << i, sum.lat[i]);
+	}
+	return 0;
+}
+
+static int sbull_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sbull_stats_show, inode->i_private);
+}
+
+static int sbull_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sbull_latency_show, inode->i_private);
+}
+
+static const struct file_operations sbull_stats_fops = {
+	.owner   = THIS_MODULE,
+	.open    = sbull_stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations sbull_latency_fops = {
+	.owner   = THIS_MODULE,
+	.open    = sbull_latency_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
 
 /*
- * Handle an I/O request.
+ * Backing store management.
  */
-static void sbull_transfer(struct sbull_dev *dev, unsigned long sector,
-		unsigned long nsect, char *buffer, int write)
+static struct sbull_shard *sbull_shard(struct sbull_dev *dev, pgoff_t idx)
 {
-	unsigned long offset = sector*KERNEL_SECTOR_SIZE;
-	unsigned long nbytes = nsect*KERNEL_SECTOR_SIZE;
+	return &dev->shards[(idx >> SBULL_REGION_SHIFT) % SBULL_SHARDS];
+}
+
+/*
+ * Only make_request is called where we can sleep; the request
+ * functions run under the queue lock and blk-mq may run with
+ * preemption off.
+ */
+static gfp_t sbull_gfp(void)
+{
+	return request_mode == RM_NOQUEUE ? GFP_NOIO : GFP_ATOMIC;
+}
+
+/*
+ * Add a zeroed page at "idx".  Losing the race against another
+ * writer is fine: the page is there either way.
+ */
+static int sbull_insert_page(struct sbull_shard *shard, pgoff_t idx)
+{
+	struct page *page;
+	int err;
+
+	page = alloc_page(sbull_gfp() | __GFP_ZERO | __GFP_HIGHMEM);
+	if (!page)
+		return -ENOMEM;
+	page->index = idx;
+	if (radix_tree_maybe_preload(sbull_gfp())) {
+		__free_page(page);
+		return -ENOMEM;
+	}
+	spin_lock(&shard->lock);
+	err = radix_tree_insert(&shard->pages, idx, page);
+	spin_unlock(&shard->lock);
+	radix_tree_preload_end();
+	if (err)
+		__free_page(page);
+	return err == -EEXIST ? 0 : err;
+}
+
+/*
+ * Copy between a piece of one page of the disk and a piece of an
+ * I/O page.  The copy happens under the shard lock, so that a discard
+ * can't free the page under us.  Whole pages go through copy_highpage,
+ * which maps both at once and copies a page at a time; pages never
+ * written read as zeroes.
+ */
+static int sbull_copy_page(struct sbull_dev *dev, u64 pos, struct page *page,
+		unsigned int offset, unsigned int len, int write)
+{
+	pgoff_t idx = pos >> PAGE_SHIFT;
+	struct sbull_shard *shard = sbull_shard(dev, idx);
+	struct page *store;
+	void *src, *dst;
+
+	spin_lock(&shard->lock);
+	store = radix_tree_lookup(&shard->pages, idx);
+	while (!store && write) {
+		spin_unlock(&shard->lock);
+		if (sbull_insert_page(shard, idx))
+			return -ENOMEM;
+		spin_lock(&shard->lock);
+		store = radix_tree_lookup(&shard->pages, idx);
+	}
+	if (!store)
+		zero_user(page, offset, len);
+	else if (len == PAGE_SIZE)
+		copy_highpage(write ? store : page, write ? page : store);
+	else if (write) {
+		src = kmap_atomic(page);
+		dst = kmap_atomic(store);
+		memcpy(dst + offset_in_page(pos), src + offset, len);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+	} else {
+		src = kmap_atomic(store);
+		dst = kmap_atomic(page);
+		memcpy(dst + offset, src + offset_in_page(pos), len);
+		kunmap_atomic(dst);
+		kunmap_atomic(src);
+	}
+	spin_unlock(&shard->lock);
+	if (!write)
+		flush_dcache_page(page);
+	return 0;
+}
+
+/*
+ * Drop a piece of the disk: whole pages go back to the system,
+ * partial ones are zeroed, so that it reads back as zeroes.
+ */
+static void sbull_discard(struct sbull_dev *dev, sector_t sector,
+		unsigned long nbytes)
+{
+	u64 pos = (u64) sector*KERNEL_SECTOR_SIZE;
+	struct sbull_shard *shard;
+	struct page *page;
+	unsigned int chunk;
+	void *kaddr;
+
+	while (nbytes) {
+		chunk = min_t(unsigned long, nbytes,
+				PAGE_SIZE - offset_in_page(pos));
+		shard = sbull_shard(dev, pos >> PAGE_SHIFT);
+		spin_lock(&shard->lock);
+		if (chunk == PAGE_SIZE) {
+			page = radix_tree_delete(&shard->pages,
+					pos >> PAGE_SHIFT);
+			if (page)
+				__free_page(page);
+		} else {
+			page = radix_tree_lookup(&shard->pages,
+					pos >> PAGE_SHIFT);
+			if (page) {
+				kaddr = kmap_atomic(page);
+				memset(kaddr + offset_in_page(pos), 0, chunk);
+				kunmap_atomic(kaddr);
+			}
+		}
+		spin_unlock(&shard->lock);
+		pos += chunk;
+		nbytes -= chunk;
+	}
+}
+
+/*
+ * Give all the pages back, as on a media change.  No I/O can be
+ * running on the device.
+ */
+static void sbull_free_pages(struct sbull_dev *dev)
+{
+	struct page *pages[16];
+	pgoff_t idx;
+	int i, j, n;
+
+	for (i = 0; i < SBULL_SHARDS; i++) {
+		struct sbull_shard *shard = dev->shards + i;
+
+		idx = 0;
+		do {
+			spin_lock(&shard->lock);
+			n = radix_tree_gang_lookup(&shard->pages,
+					(void **) pages, idx, ARRAY_SIZE(pages));
+			for (j = 0; j < n; j++) {
+				idx = pages[j]->index + 1;
+				radix_tree_delete(&shard->pages, pages[j]->index);
+			}
+			spin_unlock(&shard->lock);
+			for (j = 0; j < n; j++)
+				__free_page(pages[j]);
+		} while (n);
+	}
+}
+
+/*
+ * Is this range on the disk?
+ */
+static int sbull_check_range(struct sbull_dev *dev, sector_t sector,
+		unsigned long nbytes)
+{
+	u64 offset = (u64) sector*KERNEL_SECTOR_SIZE;
 
 	if ((offset + nbytes) > dev->size) {
-		printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
-		return;
+		printk (KERN_NOTICE "Beyond-end write (%lld %ld)\n",
+				(long long) offset, nbytes);
+		return -EIO;
 	}
-	if (write)
-		memcpy(dev->data + offset, buffer, nbytes);
-	else
-		memcpy(buffer, dev->data + offset, nbytes);
+	return 0;
+}
+
+/*
+ * Handle an I/O request: move one bio_vec, which may cover several
+ * pages, to or from the disk.  Each step stays within one page on
+ * both sides, so aligned segments go a whole page at a time.
+ */
+static int sbull_transfer(struct sbull_dev *dev, sector_t sector,
+		struct bio_vec *bvec, int write)
+{
+	u64 pos = (u64) sector*KERNEL_SECTOR_SIZE;
+	unsigned int offset = bvec->bv_offset;
+	unsigned int len = bvec->bv_len;
+	unsigned int chunk;
+	int ret;
+
+	while (len) {
+		chunk = min_t(unsigned int, len, PAGE_SIZE - offset_in_page(pos));
+		chunk = min_t(unsigned int, chunk, PAGE_SIZE - offset_in_page(offset));
+		ret = sbull_copy_page(dev, pos, nth_page(bvec->bv_page,
+				offset >> PAGE_SHIFT), offset_in_page(offset),
+				chunk, write);
+		if (ret)
+			return ret;
+		pos += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return 0;
 }
 
 /*
- * The simple form of the request function.
+ * The simple form of the request function.  It moves one segment at a
+ * time, and holds on to the request until the last one is done.
  */
 static void sbull_request(struct request_queue *q)
 {
 	struct request *req;
-
-	while ((req = blk_fetch_request(q)) != NULL) {
+	struct bio_vec bvec;
+	unsigned int sectors = 0, merges = 0;
+	u64 start = 0;
+	int ret;
+
+	req = blk_fetch_request(q);
+	if (req) {
+		start = ktime_get_ns();
+		sectors = blk_rq_sectors(req);
+		merges = sbull_rq_merges(req);
+	}
+	while (req) {
 		struct sbull_dev *dev = req->rq_disk->private_data;
 		if (req->cmd_type != REQ_TYPE_FS) {
 			printk (KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request_cur(req, -EIO);
-			continue;
+			__blk_end_request_all(req, -EIO);
+			goto next;
+		}
+		if (req->cmd_flags & REQ_DISCARD) {
+			sbull_discard(dev, blk_rq_pos(req), blk_rq_bytes(req));
+			__blk_end_request_all(req, 0);
+			goto next;
 		}
     //    	printk (KERN_NOTICE "Req dev %d dir %ld sec %ld, nr %d f %lx\n",
     //    			dev - Devices, rq_data_dir(req),
     //    			req->sector, req->current_nr_sectors,
     //    			req->flags);
-		sbull_transfer(dev, blk_rq_pos(req), blk_rq_cur_sectors(req),
-				bio_data(req->bio), rq_data_dir(req));
-		__blk_end_request_cur(req, 0);
+		/* Just the current segment */
+		bvec = bio_iter_iovec(req->bio, req->bio->bi_iter);
+		ret = sbull_check_range(dev, blk_rq_pos(req), bvec.bv_len);
+		if (!ret)
+			ret = sbull_transfer(dev, blk_rq_pos(req), &bvec,
+					rq_data_dir(req));
+		if (blk_rq_bytes(req) == bvec.bv_len)	/* the last one */
+			sbull_account(dev, rq_data_dir(req), sectors, merges,
+					start);
+		if (__blk_end_request_cur(req, ret))
+			continue;
+	  next:
+		req = blk_fetch_request(q);
+		if (req) {
+			start = ktime_get_ns();
+			sectors = blk_rq_sectors(req);
+			merges = sbull_rq_merges(req);
+		}
 	}
 }
 
@@ -130,16 +515,28 @@ static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 	struct bvec_iter i;
 	struct bio_vec bvec;
 	sector_t sector = bio->bi_iter.bi_sector;
+	int ret;
+
+	/* Check the whole bio once, not every segment */
+	ret = sbull_check_range(dev, sector, bio->bi_iter.bi_size);
+	if (ret)
+		return ret;
 
-	/* Do each segment independently. */
+	/* A discard carries no data, just a range */
+	if (bio->bi_rw & REQ_DISCARD) {
+		sbull_discard(dev, sector, bio->bi_iter.bi_size);
+		return 0;
+	}
+
+	/* Do each segment independently, straight from its pages. */
 	bio_for_each_segment(bvec, bio, i) {
-		char *buffer = __bio_kmap_atomic(bio, i);
-		sbull_transfer(dev, sector, bio_cur_bytes(bio) >> 9,
-				buffer, bio_data_dir(bio) == WRITE);
-		sector += bio_cur_bytes(bio) >> 9;
-		__bio_kunmap_atomic(bio);
+		ret = sbull_transfer(dev, sector, &bvec,
+				bio_data_dir(bio) == WRITE);
+		if (ret)
+			return ret;
+		sector += bvec.bv_len >> 9;
 	}
-	return 0; /* Always "succeed" */
+	return 0;
 }
 
 /*
@@ -148,13 +545,14 @@ static int sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
 static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 {
 	struct bio *bio;
-	int nsect = 0;
+	int ret;
     
 	__rq_for_each_bio(bio, req) {
-		sbull_xfer_bio(dev, bio);
-		nsect += bio->bi_iter.bi_size/KERNEL_SECTOR_SIZE;
+		ret = sbull_xfer_bio(dev, bio);
+		if (ret)
+			return ret;
 	}
-	return nsect;
+	return 0;
 }
 
 
@@ -165,17 +563,22 @@ static int sbull_xfer_request(struct sbull_dev *dev, struct request *req)
 static void sbull_full_request(struct request_queue *q)
 {
 	struct request *req;
-	int sectors_xferred;
 	struct sbull_dev *dev = q->queuedata;
+	u64 start;
+	int ret;
 
 	while ((req = blk_fetch_request(q)) != NULL) {
 		if (req->cmd_type != REQ_TYPE_FS) {
 			printk (KERN_NOTICE "Skip non-fs request\n");
-			__blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
+			__blk_end_request_all(req, -EIO);
 			continue;
 		}
-		sectors_xferred = sbull_xfer_request(dev, req);
-		__blk_end_request(req, 0, sectors_xferred);
+		start = ktime_get_ns();
+		ret = sbull_xfer_request(dev, req);
+		if (!(req->cmd_flags & REQ_DISCARD))
+			sbull_account(dev, rq_data_dir(req), blk_rq_sectors(req),
+					sbull_rq_merges(req), start);
+		__blk_end_request_all(req, ret);
 	}
 }
 
@@ -187,14 +590,51 @@ static void sbull_full_request(struct request_queue *q)
 static void sbull_make_request(struct request_queue *q, struct bio *bio)
 {
 	struct sbull_dev *dev = q->queuedata;
+	u64 start = ktime_get_ns();
 	int status;
 
 	status = sbull_xfer_bio(dev, bio);
+	if (!(bio->bi_rw & REQ_DISCARD))
+		sbull_account(dev, bio_data_dir(bio), bio_sectors(bio), 0, start);
 	bio_endio(bio, status);
 	return ;
 }
 
 
+/*
+ * The multiqueue version.  Each hardware queue calls in on its own,
+ * and nothing here is shared between requests: the copy only takes
+ * the lock of the shard it touches, so queues on different CPUs
+ * rarely contend.
+ */
+static int sbull_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct request *req = bd->rq;
+	struct sbull_dev *dev = hctx->queue->queuedata;
+	u64 start = ktime_get_ns();
+	int ret;
+
+	blk_mq_start_request(req);
+	if (req->cmd_type != REQ_TYPE_FS) {
+		printk (KERN_NOTICE "Skip non-fs request\n");
+		blk_mq_end_request(req, -EIO);
+		return BLK_MQ_RQ_QUEUE_OK;
+	}
+	ret = sbull_xfer_request(dev, req);
+	if (!(req->cmd_flags & REQ_DISCARD))
+		sbull_account(dev, rq_data_dir(req), blk_rq_sectors(req),
+				sbull_rq_merges(req), start);
+	blk_mq_end_request(req, ret);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops sbull_mq_ops = {
+	.queue_rq	= sbull_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+};
+
+
 /*
  * Open and close.
  */
@@ -249,7 +689,7 @@ int sbull_revalidate(struct gendisk *gd)
 	
 	if (dev->media_change) {
 		dev->media_change = 0;
-		memset (dev->data, 0, dev->size);
+		sbull_free_pages(dev);
 	}
 	return 0;
 }
@@ -263,7 +703,7 @@ void sbull_invalidate(unsigned long ldev)
 	struct sbull_dev *dev = (struct sbull_dev *) ldev;
 
 	spin_lock(&dev->lock);
-	if (dev->users || !dev->data) 
+	if (dev->users) 
 		printk (KERN_WARNING "sbull: timer sanity check failed\n");
 	else
 		dev->media_change = 1;
@@ -289,7 +729,7 @@ int sbull_ioctl (struct block_device *bdev, fmode_t mode,
 		 * and calculate the corresponding number of cylinders.  We set the
 		 * start of data at sector four.
 		 */
-		size = dev->size*(hardsect_size/KERNEL_SECTOR_SIZE);
+		size = dev->size >> 9;
 		geo.cylinders = (size & ~0x3f) >> 6;
 		geo.heads = 4;
 		geo.sectors = 16;
@@ -322,14 +762,20 @@ static struct block_device_operations sbull_ops = {
  */
 static void setup_device(struct sbull_dev *dev, int which)
 {
+	int i;
+
 	/*
-	 * Get some memory.
+	 * Memory comes later, a page at a time, as the disk is written.
 	 */
 	memset (dev, 0, sizeof (struct sbull_dev));
-	dev->size = nsectors*hardsect_size;
-	dev->data = vmalloc(dev->size);
-	if (dev->data == NULL) {
-		printk (KERN_NOTICE "vmalloc failure.\n");
+	dev->size = (u64) nsectors*hardsect_size;
+	for (i = 0; i < SBULL_SHARDS; i++) {
+		spin_lock_init(&dev->shards[i].lock);
+		INIT_RADIX_TREE(&dev->shards[i].pages, GFP_ATOMIC);
+	}
+	dev->stats = alloc_percpu(struct sbull_stats);
+	if (!dev->stats) {
+		printk (KERN_NOTICE "alloc_percpu failure\n");
 		return;
 	}
 	spin_lock_init(&dev->lock);
@@ -346,30 +792,53 @@ static void setup_device(struct sbull_dev *dev, int which)
 	 * make_request function or not.
 	 */
 	switch (request_mode) {
+	    case RM_MQ:
+		dev->tag_set.ops = &sbull_mq_ops;
+		dev->tag_set.nr_hw_queues = hw_queues > 0 ? hw_queues : nr_cpu_ids;
+		dev->tag_set.queue_depth = queue_depth;
+		dev->tag_set.numa_node = NUMA_NO_NODE;
+		dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+		dev->tag_set.driver_data = dev;
+		if (blk_mq_alloc_tag_set(&dev->tag_set))
+			return;
+		dev->queue = blk_mq_init_queue(&dev->tag_set);
+		if (IS_ERR(dev->queue)) {
+			blk_mq_free_tag_set(&dev->tag_set);
+			dev->queue = NULL;
+			return;
+		}
+		break;
+
 	    case RM_NOQUEUE:
 		dev->queue = blk_alloc_queue(GFP_KERNEL);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		blk_queue_make_request(dev->queue, sbull_make_request);
 		break;
 
 	    case RM_FULL:
 		dev->queue = blk_init_queue(sbull_full_request, &dev->lock);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 
 	    default:
 		printk(KERN_NOTICE "Bad request mode %d, using simple\n", request_mode);
+		request_mode = RM_SIMPLE;
         	/* fall into.. */
 	
 	    case RM_SIMPLE:
 		dev->queue = blk_init_queue(sbull_request, &dev->lock);
 		if (dev->queue == NULL)
-			goto out_vfree;
+			return;
 		break;
 	}
 	blk_queue_logical_block_size(dev->queue, hardsect_size);
+	/* Discarded ranges give their pages back and read as zeroes */
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, dev->queue);
+	dev->queue->limits.discard_granularity = PAGE_SIZE;
+	blk_queue_max_discard_sectors(dev->queue, UINT_MAX >> 9);
+	dev->queue->limits.discard_zeroes_data = 1;
 	dev->queue->queuedata = dev;
 	/*
 	 * And the gendisk structure.
@@ -377,7 +846,7 @@ static void setup_device(struct sbull_dev *dev, int which)
 	dev->gd = alloc_disk(SBULL_MINORS);
 	if (! dev->gd) {
 		printk (KERN_NOTICE "alloc_disk failure\n");
-		goto out_vfree;
+		return;
 	}
 	dev->gd->major = sbull_major;
 	dev->gd->first_minor = which*SBULL_MINORS;
@@ -387,11 +856,18 @@ static void setup_device(struct sbull_dev *dev, int which)
 	snprintf (dev->gd->disk_name, 32, "sbull%c", which + 'a');
 	set_capacity(dev->gd, nsectors*(hardsect_size/KERNEL_SECTOR_SIZE));
 	add_disk(dev->gd);
-	return;
 
-  out_vfree:
-	if (dev->data)
-		vfree(dev->data);
+	/*
+	 * Statistics under /sys/kernel/debug/sbull/<disk>; it's fine if
+	 * debugfs isn't there.
+	 */
+	dev->debugfs = debugfs_create_dir(dev->gd->disk_name, sbull_debugfs);
+	if (!IS_ERR_OR_NULL(dev->debugfs)) {
+		debugfs_create_file("stats", S_IRUGO, dev->debugfs, dev,
+				&sbull_stats_fops);
+		debugfs_create_file("latency", S_IRUGO, dev->debugfs, dev,
+				&sbull_latency_fops);
+	}
 }
 
 
@@ -413,6 +889,7 @@ static int __init sbull_init(void)
 	Devices = kmalloc(ndevices*sizeof (struct sbull_dev), GFP_KERNEL);
 	if (Devices == NULL)
 		goto out_unregister;
+	sbull_debugfs = debugfs_create_dir("sbull", NULL);
 	for (i = 0; i < ndevices; i++) 
 		setup_device(Devices + i, i);
     
@@ -427,6 +904,7 @@ static void sbull_exit(void)
 {
 	int i;
 
+	debugfs_remove_recursive(sbull_debugfs);
 	for (i = 0; i < ndevices; i++) {
 		struct sbull_dev *dev = Devices + i;
 
@@ -440,9 +918,11 @@ static void sbull_exit(void)
 				kobject_put (&dev->queue->kobj);
 			else
 				blk_cleanup_queue(dev->queue);
+			if (request_mode == RM_MQ)
+				blk_mq_free_tag_set(&dev->tag_set);
 		}
-		if (dev->data)
-			vfree(dev->data);
+		sbull_free_pages(dev);
+		free_percpu(dev->stats);
 	}
 	unregister_blkdev(sbull_major, "sbull");
 	kfree(Devices);
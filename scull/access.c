@@ -28,6 +28,7 @@
 #include <linux/tty.h>
 #include <asm/atomic.h>
 #include <linux/list.h>
+#include <linux/radix-tree.h>
 #include <linux/cred.h> /* current_uid(), current_euid() */
 #include <linux/sched.h>
 
@@ -262,8 +263,9 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
+	INIT_RADIX_TREE(&lptr->device.qsets, GFP_KERNEL);
 	scull_trim(&(lptr->device)); /* initialize it */
-	sema_init(&(lptr->device.sem), 1);
+	init_rwsem(&(lptr->device.sem));
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -349,7 +351,8 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	/* Initialize the device structure */
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	sema_init(&dev->sem, 1);
+	INIT_RADIX_TREE(&dev->qsets, GFP_KERNEL);
+	init_rwsem(&dev->sem);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -27,6 +27,7 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/radix-tree.h>
 
 #include <asm/uaccess.h>	/* copy_*_user */
 
@@ -54,30 +55,42 @@ MODULE_LICENSE("Dual BSD/GPL");
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
 
+/*
+ * Return the first quantum set at or after item "index", or NULL.
+ * The caller must hold the device semaphore, for reading at least.
+ */
+static struct scull_qset *scull_next_qset(struct scull_dev *dev,
+		unsigned long index)
+{
+	struct scull_qset *qs;
+
+	if (radix_tree_gang_lookup(&dev->qsets, (void **) &qs, index, 1) == 0)
+		return NULL;
+	return qs;
+}
+
 /*
  * Empty out the scull device; must be called with the device
- * semaphore held.
+ * semaphore held for writing.
  */
 int scull_trim(struct scull_dev *dev)
 {
-	struct scull_qset *next, *dptr;
+	struct scull_qset *dptr;
 	int qset = dev->qset;   /* "dev" is not-null */
 	int i;
 
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
+	while ((dptr = scull_next_qset(dev, 0))) { /* all the list items */
+		radix_tree_delete(&dev->qsets, dptr->index);
 		if (dptr->data) {
 			for (i = 0; i < qset; i++)
 				kfree(dptr->data[i]);
 			kfree(dptr->data);
-			dptr->data = NULL;
 		}
-		next = dptr->next;
 		kfree(dptr);
 	}
 	dev->size = 0;
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	dev->data = NULL;
 	return 0;
 }
 #ifdef SCULL_DEBUG /* use proc only if debugging */
@@ -90,24 +103,25 @@ int scull_trim(struct scull_dev *dev)
 
 	for (i = 0; i < scull_nr_devs ; i++) {
 		struct scull_dev *d = &scull_devices[i];
-		struct scull_qset *qs = d->data;
-		if (down_interruptible(&d->sem))
+		struct scull_qset *qs, *last = NULL;
+		if (down_read_killable(&d->sem))
 			return -ERESTARTSYS;
 		seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
 				i, d->qset, d->quantum, d->size);
 		
-		for (; qs ; qs = qs->next) { /* scan the list */
-			seq_printf(s, "  item at %p, qset at %p\n",
-					qs, qs->data);
-			if (qs->data && !qs->next) /* dump only the last item */
-				for (j = 0; j < d->qset; j++) {
-					if (qs->data[j])
-						seq_printf(s,
-								"    % 4i: %8p\n",
-								j, qs->data[j]);
-				}
+		for (qs = scull_next_qset(d, 0); qs;
+				qs = scull_next_qset(d, qs->index + 1)) {
+			seq_printf(s, "  item %lu at %p, qset at %p\n",
+					qs->index, qs, qs->data);
+			last = qs;
 		}
-		up(&scull_devices[i].sem);
+		if (last && last->data) /* dump only the last item */
+			for (j = 0; j < d->qset; j++) {
+				if (last->data[j])
+					seq_printf(s, "    % 4i: %8p\n",
+							j, last->data[j]);
+			}
+		up_read(&scull_devices[i].sem);
 	}
 
 	return 0;
@@ -158,24 +172,27 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
+	struct scull_qset *d, *last = NULL;
 	int i;
 
-	if (down_interruptible(&dev->sem))
+	if (down_read_killable(&dev->sem))
 		return -ERESTARTSYS;
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
-			}
+	for (d = scull_next_qset(dev, 0); d;
+			d = scull_next_qset(dev, d->index + 1)) {
+		seq_printf(s, "  item %lu at %p, qset at %p\n",
+				d->index, d, d->data);
+		last = d;
 	}
-	up(&dev->sem);
+	if (last && last->data) /* dump only the last item */
+		for (i = 0; i < dev->qset; i++) {
+			if (last->data[i])
+				seq_printf(s, "    % 4i: %8p\n",
+						i, last->data[i]);
+		}
+	up_read(&dev->sem);
 	return 0;
 }
 	
@@ -245,10 +262,10 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+		if (down_write_killable(&dev->sem))
 			return -ERESTARTSYS;
 		scull_trim(dev); /* ignore errors */
-		up(&dev->sem);
+		up_write(&dev->sem);
 	}
 	return 0;          /* success */
 }
@@ -258,32 +275,36 @@ int scull_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 /*
- * Follow the list
+ * Find the quantum set for list item "n".  The radix tree gets there
+ * in a few steps whatever the offset; missing items are allocated
+ * only if "create" is set, so holes cost no memory.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long n,
+		int create)
 {
-	struct scull_qset *qs = dev->data;
-
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
-			return NULL;  /* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
-	}
-
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
-		}
-		qs = qs->next;
-		continue;
+	struct scull_qset *qs;
+
+	qs = radix_tree_lookup(&dev->qsets, n);
+	if (qs || !create)
+		return qs;
+
+	qs = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+	if (qs == NULL)
+		return NULL;  /* Never mind */
+	memset(qs, 0, sizeof(struct scull_qset));
+	qs->index = n;
+	if (radix_tree_preload(GFP_KERNEL))
+		goto fail;
+	if (radix_tree_insert(&dev->qsets, n, qs)) {
+		radix_tree_preload_end();
+		goto fail;
 	}
+	radix_tree_preload_end();
 	return qs;
+
+  fail:
+	kfree(qs);
+	return NULL;
 }
 
 /*
@@ -294,43 +315,52 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
+	struct scull_qset *dptr = NULL;	/* the current listitem */
 	int quantum = dev->quantum, qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	unsigned long item, dptr_item = 0;
+	int s_pos, q_pos, rest;
+	size_t chunk;
 	ssize_t retval = 0;
 
-	if (down_interruptible(&dev->sem))
+	/* readers only look things up: they can run concurrently */
+	if (down_read_killable(&dev->sem))
 		return -ERESTARTSYS;
 	if (*f_pos >= dev->size)
 		goto out;
 	if (*f_pos + count > dev->size)
 		count = dev->size - *f_pos;
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
-
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
-
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
-
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+	/* copy one quantum at a time, all under a single lock */
+	while (count > 0) {
+		/* find listitem, qset index, and offset in the quantum */
+		item = (unsigned long)*f_pos / itemsize;
+		rest = (unsigned long)*f_pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		/* look up the right position (defined elsewhere) */
+		if (!dptr || item != dptr_item) {
+			dptr = scull_follow(dev, item, 0);
+			dptr_item = item;
+		}
+		if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
+			break; /* don't fill holes */
+
+		/* read only up to the end of this quantum */
+		chunk = min(count, (size_t)(quantum - q_pos));
+		if (copy_to_user(buf, dptr->data[s_pos] + q_pos, chunk)) {
+			if (retval == 0)
+				retval = -EFAULT;
+			break;
+		}
+		*f_pos += chunk;
+		buf += chunk;
+		count -= chunk;
+		retval += chunk;
 	}
-	*f_pos += count;
-	retval = count;
 
   out:
-	up(&dev->sem);
+	up_read(&dev->sem);
 	return retval;
 }
 
@@ -338,52 +368,64 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
+	struct scull_qset *dptr = NULL;
 	int quantum = dev->quantum, qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
+	unsigned long item, dptr_item = 0;
+	int s_pos, q_pos, rest;
+	size_t chunk, done = 0;
 	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
 
-	if (down_interruptible(&dev->sem))
+	/* writers may allocate quanta and change the size: go exclusive */
+	if (down_write_killable(&dev->sem))
 		return -ERESTARTSYS;
 
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
+	/* copy one quantum at a time, all under a single lock */
+	while (count > 0) {
+		/* find listitem, qset index and offset in the quantum */
+		item = (unsigned long)*f_pos / itemsize;
+		rest = (unsigned long)*f_pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		/* find the right position, allocating it if need be */
+		if (!dptr || item != dptr_item) {
+			dptr = scull_follow(dev, item, 1);
+			dptr_item = item;
+		}
+		if (dptr == NULL)
 			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
+		if (!dptr->data) {
+			dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
+			if (!dptr->data)
+				goto out;
+			memset(dptr->data, 0, qset * sizeof(char *));
+		}
+		if (!dptr->data[s_pos]) {
+			dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
+			if (!dptr->data[s_pos])
+				goto out;
+		}
+		/* write only up to the end of this quantum */
+		chunk = min(count, (size_t)(quantum - q_pos));
+		if (copy_from_user(dptr->data[s_pos]+q_pos, buf, chunk)) {
+			retval = -EFAULT;
 			goto out;
+		}
+		*f_pos += chunk;
+		buf += chunk;
+		count -= chunk;
+		done += chunk;
 	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*f_pos += count;
-	retval = count;
+  out:
+	/* a partial transfer is still a success */
+	if (done || count == 0)
+		retval = done;
 
         /* update the size */
 	if (dev->size < *f_pos)
 		dev->size = *f_pos;
-
-  out:
-	up(&dev->sem);
+	up_write(&dev->sem);
 	return retval;
 }
 
@@ -649,7 +691,8 @@ int scull_init_module(void)
 	for (i = 0; i < scull_nr_devs; i++) {
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
-		sema_init(&scull_devices[i].sem, 1);
+		INIT_RADIX_TREE(&scull_devices[i].qsets, GFP_KERNEL);
+		init_rwsem(&scull_devices[i].sem);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
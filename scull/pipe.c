@@ -29,15 +29,34 @@
 #include <asm/uaccess.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
+#include <linux/log2.h>		/* roundup_pow_of_two() */
+#include <linux/mm.h>		/* remap_pfn_range() */
 
 #include "scull.h"		/* local definitions */
 
+/*
+ * The buffer is a ring whose size is a power of two.  "head" and
+ * "tail" are free-running indices: head - tail is the amount of data
+ * and masking with buffersize - 1 gives the position in the buffer.
+ * Only the writer moves head and only the reader moves tail, so a
+ * "lockless" device, limited to one reader and one writer, needs no
+ * semaphore on the data path.
+ *
+ * The indices live in a page of their own (struct scull_p_ring, see
+ * scull.h) so that a lockless ring can be mapped, together with the
+ * buffer, and produced or consumed in place by user space.
+ */
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
-        char *buffer, *end;                /* begin of buf, end of buf */
-        int buffersize;                    /* used in pointer arithmetic */
-        char *rp, *wp;                     /* where to read, where to write */
+        char *buffer;                      /* the ring itself */
+        unsigned int buffersize;           /* a power of two */
+        unsigned int ringsize;             /* set by ioctl, 0 for default */
+        struct scull_p_ring *ring;         /* head and tail, shared page */
+        int lockless;                      /* single reader/writer, no sem */
         int nreaders, nwriters;            /* number of openings for r/w */
+        int nrdwr;                         /* how many of them are both */
+        unsigned int highwater;            /* most data ever buffered */
+        unsigned long nfull;               /* times a writer found it full */
         struct fasync_struct *async_queue; /* asynchronous readers */
         struct semaphore sem;              /* mutual exclusion semaphore */
         struct cdev cdev;                  /* Char device structure */
@@ -46,15 +65,91 @@ struct scull_pipe {
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_lockless = 0;	/* bitmask of lockless devices */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_lockless, int, 0);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
-static int spacefree(struct scull_pipe *dev);
+static unsigned int scull_p_free(struct scull_pipe *dev);
+
+/*
+ * Lockless devices rely on the index ordering alone; the others
+ * still serialize readers and writers on the semaphore.
+ */
+static int scull_p_lock(struct scull_pipe *dev)
+{
+	if (dev->lockless)
+		return 0;
+	return down_interruptible(&dev->sem);
+}
+
+static void scull_p_unlock(struct scull_pipe *dev)
+{
+	if (!dev->lockless)
+		up(&dev->sem);
+}
+
+/*
+ * How much data is there?  Pairs with the writer's release of head.
+ * A mapped ring gets its indices from user space, so never believe
+ * in more than a full buffer.
+ */
+static unsigned int scull_p_avail(struct scull_pipe *dev)
+{
+	return min(smp_load_acquire(&dev->ring->head) -
+			READ_ONCE(dev->ring->tail), dev->buffersize);
+}
+
+/*
+ * Remember how full the ring ever got, to help sizing it.  Updated
+ * by the writer only (or under the semaphore), so no atomics.
+ */
+static void scull_p_highwater(struct scull_pipe *dev)
+{
+	unsigned int used = dev->buffersize - scull_p_free(dev);
+
+	if (used > dev->highwater)
+		dev->highwater = used;
+}
+
+/*
+ * Wake up the other side, but only if somebody is waiting.  The
+ * barrier orders our index update against the sleeper's own check
+ * of the condition after it queued itself.
+ */
+static void scull_p_wake(wait_queue_head_t *q)
+{
+	smp_mb();
+	if (waitqueue_active(q))
+		wake_up_interruptible(q);
+}
+
+/*
+ * Release the ring and its control page; the next open allocates
+ * them again.
+ */
+static void scull_p_free_buffer(struct scull_pipe *dev)
+{
+	if (dev->buffer)
+		free_pages((unsigned long) dev->buffer,
+				get_order(dev->buffersize));
+	free_page((unsigned long) dev->ring);
+	dev->buffer = NULL; /* the other fields are not checked on open */
+	dev->ring = NULL;
+}
+
+/* Was the file opened for both reading and writing? */
+static int scull_p_rdwr(struct file *filp)
+{
+	return (filp->f_mode & (FMODE_READ | FMODE_WRITE)) ==
+		(FMODE_READ | FMODE_WRITE);
+}
+
 /*
  * Open and close
  */
@@ -69,23 +164,41 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 	if (down_interruptible(&dev->sem))
 		return -ERESTARTSYS;
+	/*
+	 * A lockless ring has room for one reader and one writer only.
+	 * Read-write opens are left out of the count: they are how the
+	 * ring gets mapped, and a mapping plays just one of the two roles.
+	 * So that they cannot play both, read and write refuse them.
+	 */
+	if (dev->lockless && !scull_p_rdwr(filp) &&
+	    (((filp->f_mode & FMODE_READ) && dev->nreaders > dev->nrdwr) ||
+	     ((filp->f_mode & FMODE_WRITE) && dev->nwriters > dev->nrdwr))) {
+		up(&dev->sem);
+		return -EBUSY;
+	}
 	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
+		/* allocate whole pages, so that the ring can be mapped */
+		dev->buffersize = dev->ringsize ? dev->ringsize :
+			roundup_pow_of_two(max(scull_p_buffer, 2));
+		dev->buffer = (char *) __get_free_pages(GFP_KERNEL,
+				get_order(dev->buffersize));
+		dev->ring = (struct scull_p_ring *) get_zeroed_page(GFP_KERNEL);
+		if (!dev->buffer || !dev->ring) {
+			scull_p_free_buffer(dev);
 			up(&dev->sem);
 			return -ENOMEM;
 		}
+		/* rd and wr from the beginning */
+		dev->ring->size = dev->buffersize;
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
 		dev->nreaders++;
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters++;
+	if (scull_p_rdwr(filp))
+		dev->nrdwr++;
 	up(&dev->sem);
 
 	return nonseekable_open(inode, filp);
@@ -104,10 +217,10 @@ static int scull_p_release(struct inode *inode, struct file *filp)
 		dev->nreaders--;
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
-	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer = NULL; /* the other fields are not checked on open */
-	}
+	if (scull_p_rdwr(filp))
+		dev->nrdwr--;
+	if (dev->nreaders + dev->nwriters == 0)
+		scull_p_free_buffer(dev);
 	up(&dev->sem);
 	return 0;
 }
@@ -121,104 +234,112 @@ static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
+	unsigned int tail, off;
+	size_t chunk;
 
-	if (down_interruptible(&dev->sem))
+	if (dev->lockless && scull_p_rdwr(filp))
+		return -EPERM;
+	if (scull_p_lock(dev))
 		return -ERESTARTSYS;
 
-	while (dev->rp == dev->wp) { /* nothing to read */
-		up(&dev->sem); /* release the lock */
+	while (scull_p_avail(dev) == 0) { /* nothing to read */
+		scull_p_unlock(dev); /* release the lock */
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		if (wait_event_interruptible(dev->inq, scull_p_avail(dev) != 0))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
-		if (down_interruptible(&dev->sem))
+		if (scull_p_lock(dev))
 			return -ERESTARTSYS;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		up (&dev->sem);
+	/* ok, data is there, return it: two pieces if it wraps */
+	count = min(count, (size_t)scull_p_avail(dev));
+	tail = dev->ring->tail;
+	off = tail & (dev->buffersize - 1);
+	chunk = min(count, (size_t)(dev->buffersize - off));
+	if (copy_to_user(buf, dev->buffer + off, chunk) ||
+	    copy_to_user(buf + chunk, dev->buffer, count - chunk)) {
+		scull_p_unlock(dev);
 		return -EFAULT;
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	up (&dev->sem);
+	/* the writer may reuse the space as soon as it sees the new tail */
+	smp_store_release(&dev->ring->tail, tail + count);
+	scull_p_unlock(dev);
 
 	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
+	scull_p_wake(&dev->outq);
 	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
 	return count;
 }
 
-/* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
+/* Wait for space for writing; caller must hold the device lock (see
+ * scull_p_lock).  On error the lock will be released before returning. */
 static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 {
-	while (spacefree(dev) == 0) { /* full */
+	while (scull_p_free(dev) == 0) { /* full */
 		DEFINE_WAIT(wait);
 		
-		up(&dev->sem);
+		dev->nfull++;
+		scull_p_unlock(dev);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (scull_p_free(dev) == 0)
 			schedule();
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-		if (down_interruptible(&dev->sem))
+		if (scull_p_lock(dev))
 			return -ERESTARTSYS;
 	}
 	return 0;
 }	
 
-/* How much space is free? */
-static int spacefree(struct scull_pipe *dev)
+/* How much space is free?  Pairs with the reader's release of tail */
+static unsigned int scull_p_free(struct scull_pipe *dev)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	return dev->buffersize - min(READ_ONCE(dev->ring->head) -
+			smp_load_acquire(&dev->ring->tail), dev->buffersize);
 }
 
 static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scull_pipe *dev = filp->private_data;
+	unsigned int head, off;
+	size_t chunk;
 	int result;
 
-	if (down_interruptible(&dev->sem))
+	if (dev->lockless && scull_p_rdwr(filp))
+		return -EPERM;
+	if (scull_p_lock(dev))
 		return -ERESTARTSYS;
 
 	/* Make sure there's space to write */
 	result = scull_getwritespace(dev, filp);
 	if (result)
-		return result; /* scull_getwritespace called up(&dev->sem) */
-
-	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
-		up (&dev->sem);
+		return result; /* scull_getwritespace released the lock */
+
+	/* ok, space is there, accept something: two pieces if it wraps */
+	count = min(count, (size_t)scull_p_free(dev));
+	head = dev->ring->head;
+	off = head & (dev->buffersize - 1);
+	chunk = min(count, (size_t)(dev->buffersize - off));
+	PDEBUG("Going to accept %li bytes to %u from %p\n", (long)count, off, buf);
+	if (copy_from_user(dev->buffer + off, buf, chunk) ||
+	    copy_from_user(dev->buffer, buf + chunk, count - chunk)) {
+		scull_p_unlock(dev);
 		return -EFAULT;
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
-	up(&dev->sem);
+	/* publish the data before the reader can see the new head */
+	smp_store_release(&dev->ring->head, head + count);
+	scull_p_highwater(dev);
+	scull_p_unlock(dev);
 
 	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	scull_p_wake(&dev->inq);  /* blocked in read() and select() */
 
 	/* and signal asynchronous readers, explained late in chapter 5 */
 	if (dev->async_queue)
@@ -234,17 +355,17 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 
 	/*
 	 * The buffer is circular; it is considered full
-	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * if "head" is a whole buffer ahead of "tail" and empty
+	 * if the two are equal.  The indices are only ever
+	 * published with release semantics, so no lock is needed
+	 * to look at them.
 	 */
-	down(&dev->sem);
 	poll_wait(filp, &dev->inq,  wait);
 	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	if (scull_p_avail(dev))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (scull_p_free(dev))
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	up(&dev->sem);
 	return mask;
 }
 
@@ -260,6 +381,122 @@ static int scull_p_fasync(int fd, struct file *filp, int mode)
 }
 
 
+/*
+ * Map a lockless ring: the control page at offset 0, followed by the
+ * buffer (map the control page alone first to learn its size).  User
+ * space then moves head or tail by itself, and only calls in
+ * (SCULL_P_IOCKICK, read, write, poll) to wait or to wake the other
+ * side.  Devices using the semaphore can't be mapped, as user space
+ * would not take it.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = filp->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+
+	if (!dev->lockless)
+		return -EINVAL;
+	if (vma->vm_pgoff != 0 || len > PAGE_SIZE + PAGE_ALIGN(dev->buffersize))
+		return -EINVAL;
+
+	/* both areas are plain pages that live until the last close */
+	if (remap_pfn_range(vma, vma->vm_start,
+			page_to_pfn(virt_to_page(dev->ring)),
+			PAGE_SIZE, vma->vm_page_prot))
+		return -EAGAIN;
+	if (len > PAGE_SIZE && remap_pfn_range(vma, vma->vm_start + PAGE_SIZE,
+			page_to_pfn(virt_to_page(dev->buffer)),
+			len - PAGE_SIZE, vma->vm_page_prot))
+		return -EAGAIN;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	return 0;
+}
+
+
+/*
+ * Change the size of one ring, keeping what is buffered.  The new
+ * size is rounded up to a power of two and must hold the current
+ * data.  Lockless rings are left alone: their reader and writer don't
+ * take the semaphore, so nothing would stop them from running while
+ * the buffer is replaced.
+ */
+static int scull_p_resize(struct scull_pipe *dev, unsigned long size)
+{
+	unsigned int used, tail, off, chunk;
+	char *buffer;
+
+	if (dev->lockless)
+		return -EBUSY;
+	size = roundup_pow_of_two(max(size, 2UL));
+	if (get_order(size) >= MAX_ORDER)
+		return -EINVAL;
+	buffer = (char *) __get_free_pages(GFP_KERNEL, get_order(size));
+	if (!buffer)
+		return -ENOMEM;
+
+	if (down_interruptible(&dev->sem)) {
+		free_pages((unsigned long) buffer, get_order(size));
+		return -ERESTARTSYS;
+	}
+	used = dev->buffersize - scull_p_free(dev);
+	if (used > size) {
+		up(&dev->sem);
+		free_pages((unsigned long) buffer, get_order(size));
+		return -EBUSY;
+	}
+	/* copy the data over, unwrapped at the start of the new ring */
+	tail = dev->ring->tail;
+	off = tail & (dev->buffersize - 1);
+	chunk = min(used, dev->buffersize - off);
+	memcpy(buffer, dev->buffer + off, chunk);
+	memcpy(buffer + chunk, dev->buffer, used - chunk);
+	free_pages((unsigned long) dev->buffer, get_order(dev->buffersize));
+
+	dev->buffer = buffer;
+	dev->buffersize = dev->ringsize = size;
+	dev->ring->size = size;
+	dev->ring->tail = 0;
+	dev->ring->head = used;
+	dev->highwater = used;
+	dev->nfull = 0;
+	up(&dev->sem);
+
+	/* there may be more room now */
+	scull_p_wake(&dev->outq);
+	return 0;
+}
+
+
+/*
+ * The pipe has a few ioctls of its own; the rest is shared with the
+ * bare scull device.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_pipe *dev = filp->private_data;
+
+	switch(cmd) {
+
+	  case SCULL_P_IOCKICK: /* a mapped ring moved: wake the other side */
+		scull_p_highwater(dev);
+		scull_p_wake(&dev->inq);
+		scull_p_wake(&dev->outq);
+		if (dev->async_queue && scull_p_avail(dev))
+			kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+		return 0;
+
+	  case SCULL_P_IOCTRESIZE: /* Tell: arg is the new size */
+		return scull_p_resize(dev, arg);
+
+	  case SCULL_P_IOCQRESIZE: /* Query: current size of this ring */
+		return dev->buffersize;
+
+	  default:
+		return scull_ioctl(filp, cmd, arg);
+	}
+}
+
+
 
 #ifdef SCULL_DEBUG /* use proc only if debugging */
 
@@ -276,8 +513,13 @@ static int scull_p_fasync(int fd, struct file *filp, int mode)
 				 return -ERESTARTSYS;
 			 seq_printf(s, "\nDevice %i: %p\n", i, p);
 	 /* 	  seq_printf(s, "	 Queues: %p %p\n", p->inq, p->outq);*/
-			 seq_printf(s,  "	 Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-			 seq_printf(s, "	 rp %p	 wp %p\n", p->rp, p->wp);
+			 seq_printf(s,  "	 Buffer: %p (%u bytes)%s\n", p->buffer, p->buffersize,
+					 p->lockless ? ", lockless" : "");
+			 if (p->ring)
+				 seq_printf(s, "	 tail %u	 head %u\n",
+						 p->ring->tail, p->ring->head);
+			 seq_printf(s, "	 high-water %u bytes, full %lu times\n",
+					 p->highwater, p->nfull);
 			 seq_printf(s,  "	 readers %i   writers %i\n", p->nreaders, p->nwriters);
 			 up(&p->sem);
 			 len += s->count;
@@ -311,7 +553,8 @@ struct file_operations scull_pipe_fops = {
 	.read =		scull_p_read,
 	.write =	scull_p_write,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl = scull_ioctl,
+	.mmap =		scull_p_mmap,
+	.unlocked_ioctl = scull_p_ioctl,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -358,6 +601,7 @@ int scull_p_init(dev_t firstdev)
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		sema_init(&scull_p_devices[i].sem, 1);
+		scull_p_devices[i].lockless = (scull_p_lockless >> i) & 1;
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
@@ -385,7 +629,7 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		scull_p_free_buffer(scull_p_devices + i);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
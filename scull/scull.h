@@ -54,9 +54,10 @@
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use a radix tree of indirect blocks, indexed by list item number,
+ * so that any offset is found without walking the whole device.
  *
- * "scull_dev->data" points to an array of pointers, each
+ * Each "scull_qset->data" points to an array of pointers, each
  * pointer refers to a memory area of SCULL_QUANTUM bytes.
  *
  * The array (quantum-set) is SCULL_QSET long.
@@ -70,27 +71,45 @@
 #endif
 
 /*
- * The pipe device is a simple circular buffer. Here its default size
+ * The pipe device is a simple circular buffer. Here its default size,
+ * which is rounded up to a power of two when the buffer is allocated
  */
 #ifndef SCULL_P_BUFFER
 #define SCULL_P_BUFFER 4000
 #endif
 
+/*
+ * The control page of a pipe ring.  A lockless scullpipe can be
+ * mmap'ed: this page comes first, the buffer follows it.  "head"
+ * (producer) and "tail" (consumer) are free-running byte counts; the
+ * data lives at (index & (size - 1)) in the buffer.  Publish your
+ * own index with a release store, read the other one with an acquire
+ * load, and use SCULL_P_IOCKICK to wake a sleeping peer.
+ */
+struct scull_p_ring {
+	unsigned int head;		/* moved by the producer */
+	unsigned int size;		/* buffer size, a power of two */
+	unsigned int __pad[14];		/* keep tail on its own cache line */
+	unsigned int tail;		/* moved by the consumer */
+};
+
+#ifdef __KERNEL__ /* the rest of the definitions are not for user space */
+
 /*
  * Representation of scull quantum sets.
  */
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
+	unsigned long index;      /* position in scull_dev->qsets */
 };
 
 struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct radix_tree_root qsets; /* quantum sets, by item number */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct semaphore sem;     /* mutual exclusion semaphore     */
+	struct rw_semaphore sem;  /* readers share, writers exclusive */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -130,6 +149,8 @@ ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
+#endif /* __KERNEL__ */
+
 
 /*
  * Ioctl definitions
@@ -169,8 +190,12 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+#define SCULL_P_IOCKICK  _IO(SCULL_IOC_MAGIC,   15)
+/* These two act on the ring of the device they are issued on */
+#define SCULL_P_IOCTRESIZE _IO(SCULL_IOC_MAGIC, 16)
+#define SCULL_P_IOCQRESIZE _IO(SCULL_IOC_MAGIC, 17)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 17
 
 #endif /* _SCULL_H_ */
@@ -26,6 +26,10 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/workqueue.h>
+#include <linux/mmu_context.h>	/* use_mm() */
+#include <linux/sched.h>	/* mmput() */
 #include <asm/uaccess.h>
 #include <linux/seq_file.h>
 #include "scullc.h"		/* local definitions */
@@ -35,11 +39,13 @@ int scullc_major =   SCULLC_MAJOR;
 int scullc_devs =    SCULLC_DEVS;	/* number of bare scullc devices */
 int scullc_qset =    SCULLC_QSET;
 int scullc_quantum = SCULLC_QUANTUM;
+int scullc_aio_depth = SCULLC_AIO_DEPTH;	/* per-device aio queue bound */
 
 module_param(scullc_major, int, 0);
 module_param(scullc_devs, int, 0);
 module_param(scullc_qset, int, 0);
 module_param(scullc_quantum, int, 0);
+module_param(scullc_aio_depth, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -412,58 +418,195 @@ loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 
 
 /*
- * A simple asynchronous I/O implementation.
+ * Asynchronous I/O.  Each device queues up to scullc_aio_depth
+ * requests for a work item that does the copy off the submitter's
+ * thread, running on the submitter's mm, and completes each batch
+ * of iocbs as soon as their data has moved.  Synchronous iocbs, and
+ * those that find the queue full, are served inline.
  */
 
-struct async_work {
+static struct workqueue_struct *scullc_wq;
+
+struct scullc_aio {
+	struct list_head list;
 	struct kiocb *iocb;
-	int result;
-	struct delayed_work work;
+	struct iov_iter iter;     /* our copy of the caller's iterator */
+	const void *iov;          /* and of its segment array */
+	struct mm_struct *mm;     /* the address space of an iovec */
+	int write;
+	ssize_t result;
 };
 
 /*
- * "Complete" an asynchronous operation.
+ * Move data between the device and any kind of iterator: user iovecs,
+ * kernel kvecs, page bvecs or a pipe.  The whole request walks the
+ * quanta under a single hold of the semaphore.
  */
-static void scullc_do_deferred_op(struct work_struct *work)
+static ssize_t scullc_do_iter(int write, struct kiocb *iocb, struct iov_iter *iter)
 {
-	struct async_work *stuff = container_of(work, struct async_work, work.work);
-	stuff->iocb->ki_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
-}
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+	struct scullc_dev *dptr;
+	int quantum = dev->quantum;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+	int s_pos, q_pos, rest;
+	loff_t pos = iocb->ki_pos;
+	size_t count, chunk, copied, done = 0;
+	ssize_t retval = 0;
 
+	if (down_interruptible (&dev->sem))
+		return -ERESTARTSYS;
+	count = iov_iter_count(iter);
+	if (!write) {
+		if (pos >= dev->size)
+			goto out;
+		if (count > dev->size - pos)
+			count = dev->size - pos;
+	}
+	if (!count)
+		goto out;
 
-static int scullc_defer_op(int write, struct kiocb *iocb, struct iov_iter* iter)
-{
-	struct async_work *stuff;
-	size_t result = 0;
-	size_t len = 0;
-	unsigned long seg = 0;
+	dptr = scullc_follow(dev, ((long) pos) / itemsize);
+	rest = ((long) pos) % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	while (count) {
+		if (write) {
+			if (!dptr->data) {
+				dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+				if (!dptr->data) {
+					retval = -ENOMEM;
+					break;
+				}
+				memset(dptr->data, 0, qset * sizeof(char *));
+			}
+			if (!dptr->data[s_pos]) {
+				dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
+				if (!dptr->data[s_pos]) {
+					retval = -ENOMEM;
+					break;
+				}
+				memset(dptr->data[s_pos], 0, scullc_quantum);
+			}
+		} else if (!dptr->data || !dptr->data[s_pos])
+			break; /* don't fill holes */
 
-	/* Copy now while we can access the buffer */
-	for (seg = 0; seg < iter->nr_segs; seg++) {
+		chunk = min_t(size_t, count, quantum - q_pos);
 		if (write)
-			len = scullc_write(iocb->ki_filp, iter->iov[seg].iov_base, iter->iov[seg].iov_len, &iocb->ki_pos);
+			copied = copy_from_iter(dptr->data[s_pos] + q_pos, chunk, iter);
 		else
-			len = scullc_read(iocb->ki_filp, iter->iov[seg].iov_base, iter->iov[seg].iov_len, &iocb->ki_pos);
+			copied = copy_to_iter(dptr->data[s_pos] + q_pos, chunk, iter);
+		pos += copied;
+		done += copied;
+		count -= copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
 
-		if (len < 0)
-			return len;
+		/* on to the next quantum, and maybe the next listitem */
+		q_pos = 0;
+		if (count && ++s_pos == qset) {
+			s_pos = 0;
+			dptr = scullc_follow(dptr, 1);
+		}
+	}
+	if (write && dev->size < pos)
+		dev->size = pos;
+	iocb->ki_pos = pos;
 
-		result += len;
+  out:
+	up (&dev->sem);
+	return done ? done : retval;
+}
+
+static void scullc_aio_work(struct work_struct *work)
+{
+	struct scullc_dev *dev = container_of(work, struct scullc_dev, aio_work);
+	struct scullc_aio *req, *next;
+	struct mm_struct *mm;
+	LIST_HEAD(batch);
+	int n;
+
+	for (;;) {
+		spin_lock(&dev->aio_lock);
+		for (n = 0; n < SCULLC_AIO_BATCH && !list_empty(&dev->aio_queue); n++)
+			list_move_tail(dev->aio_queue.next, &batch);
+		spin_unlock(&dev->aio_lock);
+		if (!n)
+			break;
+
+		/* requests from one process come in runs: switch mm rarely */
+		mm = NULL;
+		list_for_each_entry(req, &batch, list) {
+			if (req->mm != mm) {
+				if (mm)
+					unuse_mm(mm);
+				mm = req->mm;
+				if (mm)
+					use_mm(mm);
+			}
+			req->result = scullc_do_iter(req->write, req->iocb, &req->iter);
+		}
+		if (mm)
+			unuse_mm(mm);
+
+		list_for_each_entry_safe(req, next, &batch, list) {
+			list_del(&req->list);
+			req->iocb->ki_complete(req->iocb, req->result, 0);
+			if (req->mm)
+				mmput(req->mm);
+			kfree(req->iov);
+			kfree(req);
+		}
+		spin_lock(&dev->aio_lock);
+		dev->aio_depth -= n;
+		spin_unlock(&dev->aio_lock);
 	}
+}
 
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
+static ssize_t scullc_defer_op(int write, struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+	struct scullc_aio *req;
 
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_DELAYED_WORK(&stuff->work, scullc_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
+	/*
+	 * Pipes are only ever spliced synchronously; an iovec needs the
+	 * submitter's mm to be reachable from the worker.
+	 */
+	if (is_sync_kiocb(iocb) || (iter->type & ITER_PIPE) ||
+			(iter_is_iovec(iter) && !current->mm))
+		return scullc_do_iter(write, iocb, iter);
+
+	/* reserve a slot; a full queue means the caller does the work */
+	spin_lock(&dev->aio_lock);
+	if (dev->aio_depth >= scullc_aio_depth) {
+		spin_unlock(&dev->aio_lock);
+		return scullc_do_iter(write, iocb, iter);
+	}
+	dev->aio_depth++;
+	spin_unlock(&dev->aio_lock);
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (req)
+		req->iov = dup_iter(&req->iter, iter, GFP_KERNEL);
+	if (!req || !req->iov) {
+		kfree(req);
+		spin_lock(&dev->aio_lock);
+		dev->aio_depth--;
+		spin_unlock(&dev->aio_lock);
+		return scullc_do_iter(write, iocb, iter);
+	}
+	req->iocb = iocb;
+	req->write = write;
+	req->mm = iter_is_iovec(iter) ? current->mm : NULL;
+	if (req->mm)
+		atomic_inc(&req->mm->mm_users);
+
+	spin_lock(&dev->aio_lock);
+	list_add_tail(&req->list, &dev->aio_queue);
+	spin_unlock(&dev->aio_lock);
+	queue_work(scullc_wq, &dev->aio_work);
 	return -EIOCBQUEUED;
 }
 
@@ -495,6 +638,8 @@ struct file_operations scullc_fops = {
 	.release =   scullc_release,
 	.read_iter =  scullc_read_iter,
 	.write_iter = scullc_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 };
 
 int scullc_trim(struct scullc_dev *dev)
@@ -562,6 +707,13 @@ int scullc_init(void)
 	if (result < 0)
 		return result;
 
+	/* one unbound workqueue serves the aio of all devices */
+	scullc_wq = alloc_workqueue("scullc_aio", WQ_UNBOUND, 0);
+	if (!scullc_wq) {
+		result = -ENOMEM;
+		goto fail_malloc;
+	}
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -577,6 +729,9 @@ int scullc_init(void)
 		scullc_devices[i].quantum = scullc_quantum;
 		scullc_devices[i].qset = scullc_qset;
 		sema_init (&scullc_devices[i].sem, 1);
+		spin_lock_init(&scullc_devices[i].aio_lock);
+		INIT_LIST_HEAD(&scullc_devices[i].aio_queue);
+		INIT_WORK(&scullc_devices[i].aio_work, scullc_aio_work);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
@@ -593,6 +748,8 @@ int scullc_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	if (scullc_wq)
+		destroy_workqueue(scullc_wq);
 	unregister_chrdev_region(dev, scullc_devs);
 	return result;
 }
@@ -607,6 +764,9 @@ void scullc_cleanup(void)
 	remove_proc_entry("scullcmem", NULL);
 #endif
 
+	if (scullc_wq)
+		destroy_workqueue(scullc_wq); /* waits for any queued aio */
+
 	for (i = 0; i < scullc_devs; i++) {
 		cdev_del(&scullc_devices[i].cdev);
 		scullc_trim(scullc_devices + i);
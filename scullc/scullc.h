@@ -15,6 +15,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/workqueue.h>
 
 /*
  * Macros to help debugging
@@ -40,6 +41,13 @@
 
 #define SCULLC_DEVS 4    /* scullc0 through scullc3 */
 
+/*
+ * Asynchronous requests: how many a device keeps queued for its
+ * worker, and how many the worker serves before completing them.
+ */
+#define SCULLC_AIO_DEPTH 64
+#define SCULLC_AIO_BATCH 16
+
 /*
  * The bare device is a variable-length region of memory.
  * Use a linked list of indirect blocks.
@@ -60,6 +68,10 @@ struct scullc_dev {
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
 	struct semaphore sem;     /* Mutual exclusion */
+	spinlock_t aio_lock;      /* protects the aio queue and depth */
+	struct list_head aio_queue; /* requests waiting for the worker */
+	int aio_depth;            /* queued or being served */
+	struct work_struct aio_work;
 	struct cdev cdev;
 };
 
@@ -74,6 +86,7 @@ extern int scullc_major;     /* main.c */
 extern int scullc_devs;
 extern int scullc_order;
 extern int scullc_qset;
+extern int scullc_aio_depth;
 
 /*
  * Prototypes for shared functions
@@ -26,6 +26,12 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/uio.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/splice.h>
+#include <linux/workqueue.h>
+#include <linux/mmu_context.h>	/* use_mm() */
+#include <linux/sched.h>	/* mmput() */
 #include <asm/uaccess.h>
 #include "sculld.h"		/* local definitions */
 
@@ -34,11 +40,13 @@ int sculld_major =   SCULLD_MAJOR;
 int sculld_devs =    SCULLD_DEVS;	/* number of bare sculld devices */
 int sculld_qset =    SCULLD_QSET;
 int sculld_order =   SCULLD_ORDER;
+int sculld_aio_depth = SCULLD_AIO_DEPTH;	/* per-device aio queue bound */
 
 module_param(sculld_major, int, 0);
 module_param(sculld_devs, int, 0);
 module_param(sculld_qset, int, 0);
 module_param(sculld_order, int, 0);
+module_param(sculld_aio_depth, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -162,6 +170,7 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
 		if (!dev->next) {
 			dev->next = kmalloc(sizeof(struct sculld_dev), GFP_KERNEL);
 			memset(dev->next, 0, sizeof(struct sculld_dev));
+			dev->next->order = dev->order; /* same quanta throughout */
 		}
 		dev = dev->next;
 		continue;
@@ -169,6 +178,36 @@ struct sculld_dev *sculld_follow(struct sculld_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Allocate quantum "s_pos" of listitem "dptr", which is quantum number
+ * "index" of the device, and enter it in the device's quanta tree.
+ * The mmap fault path looks quanta up in the tree under RCU alone, so
+ * the memory is cleared before it is published there.
+ */
+static void *sculld_new_quantum(struct sculld_dev *dev, struct sculld_dev *dptr,
+		int s_pos, unsigned long index)
+{
+	void *quantum;
+
+	quantum = (void *)__get_free_pages(GFP_KERNEL, dptr->order);
+	if (!quantum)
+		return NULL;
+	memset(quantum, 0, PAGE_SIZE << dptr->order);
+	if (radix_tree_preload(GFP_KERNEL))
+		goto fail;
+	if (radix_tree_insert(&dev->quanta, index, quantum)) {
+		radix_tree_preload_end();
+		goto fail;
+	}
+	radix_tree_preload_end();
+	dptr->data[s_pos] = quantum;
+	return quantum;
+
+  fail:
+	free_pages((unsigned long)quantum, dptr->order);
+	return NULL;
+}
+
 /*
  * Data management: read and write
  */
@@ -249,13 +288,9 @@ ssize_t sculld_write (struct file *filp, const char __user *buf, size_t count,
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
 	/* Here's the allocation of a single quantum */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
+	if (!dptr->data[s_pos] &&
+			!sculld_new_quantum(dev, dptr, s_pos, (unsigned long) item * qset + s_pos))
+		goto nomem;
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
 	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
@@ -401,60 +436,196 @@ loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
 
 
 /*
- * A simple asynchronous I/O implementation.
+ * Asynchronous I/O.  Each device queues up to sculld_aio_depth
+ * requests for a work item that does the copy off the submitter's
+ * thread, running on the submitter's mm, and completes each batch
+ * of iocbs as soon as their data has moved.  Synchronous iocbs, and
+ * those that find the queue full, are served inline.
  */
 
-struct async_work {
+static struct workqueue_struct *sculld_wq;
+
+struct sculld_aio {
+	struct list_head list;
 	struct kiocb *iocb;
-	int result;
-	struct delayed_work work;
+	struct iov_iter iter;     /* our copy of the caller's iterator */
+	const void *iov;          /* and of its segment array */
+	struct mm_struct *mm;     /* the address space of an iovec */
+	int write;
+	ssize_t result;
 };
 
 /*
- * "Complete" an asynchronous operation.
+ * Move data between the device and any kind of iterator: user iovecs,
+ * kernel kvecs, page bvecs or a pipe.  The whole request walks the
+ * quanta under a single hold of the semaphore.
  */
-static void sculld_do_deferred_op(struct work_struct *work)
+static ssize_t sculld_do_iter(int write, struct kiocb *iocb, struct iov_iter *iter)
 {
-	struct async_work *stuff = container_of(work, struct async_work, work.work);
-        stuff->iocb->ki_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
-}
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+	struct sculld_dev *dptr;
+	int quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+	int s_pos, q_pos, rest;
+	loff_t pos = iocb->ki_pos;
+	size_t count, chunk, copied, done = 0;
+	ssize_t retval = 0;
 
-static int sculld_defer_op(int write, struct kiocb *iocb, struct iov_iter* iter)
-{
-	struct async_work *stuff;
-	size_t result = 0;
-	size_t len = 0;
-	unsigned long seg = 0;
+	if (down_interruptible (&dev->sem))
+		return -ERESTARTSYS;
+	count = iov_iter_count(iter);
+	if (!write) {
+		if (pos >= dev->size)
+			goto out;
+		if (count > dev->size - pos)
+			count = dev->size - pos;
+	}
+	if (!count)
+		goto out;
 
-	/* Copy now while we can access the buffer */
-	for (seg = 0; seg < iter->nr_segs; seg++){
+	dptr = sculld_follow(dev, ((long) pos) / itemsize);
+	rest = ((long) pos) % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	while (count) {
+		if (write) {
+			if (!dptr->data) {
+				dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+				if (!dptr->data) {
+					retval = -ENOMEM;
+					break;
+				}
+				memset(dptr->data, 0, qset * sizeof(char *));
+			}
+			if (!dptr->data[s_pos] &&
+					!sculld_new_quantum(dev, dptr, s_pos, ((long) pos) / quantum)) {
+				retval = -ENOMEM;
+				break;
+			}
+		} else if (!dptr->data || !dptr->data[s_pos])
+			break; /* don't fill holes */
+
+		chunk = min_t(size_t, count, quantum - q_pos);
 		if (write)
-			len = sculld_write(iocb->ki_filp, iter->iov[seg].iov_base, iter->iov[seg].iov_len, &iocb->ki_pos);
+			copied = copy_from_iter(dptr->data[s_pos] + q_pos, chunk, iter);
 		else
-			len = sculld_read(iocb->ki_filp, iter->iov[seg].iov_base, iter->iov[seg].iov_len, &iocb->ki_pos);
+			copied = copy_to_iter(dptr->data[s_pos] + q_pos, chunk, iter);
+		pos += copied;
+		done += copied;
+		count -= copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
 
-		if (len < 0)
-			return len;
+		/* on to the next quantum, and maybe the next listitem */
+		q_pos = 0;
+		if (count && ++s_pos == qset) {
+			s_pos = 0;
+			dptr = sculld_follow(dptr, 1);
+		}
+	}
+	if (write && dev->size < pos)
+		dev->size = pos;
+	iocb->ki_pos = pos;
 
-		result += len;
+  out:
+	up (&dev->sem);
+	return done ? done : retval;
+}
+
+static void sculld_aio_work(struct work_struct *work)
+{
+	struct sculld_dev *dev = container_of(work, struct sculld_dev, aio_work);
+	struct sculld_aio *req, *next;
+	struct mm_struct *mm;
+	LIST_HEAD(batch);
+	int n;
+
+	for (;;) {
+		spin_lock(&dev->aio_lock);
+		for (n = 0; n < SCULLD_AIO_BATCH && !list_empty(&dev->aio_queue); n++)
+			list_move_tail(dev->aio_queue.next, &batch);
+		spin_unlock(&dev->aio_lock);
+		if (!n)
+			break;
+
+		/* requests from one process come in runs: switch mm rarely */
+		mm = NULL;
+		list_for_each_entry(req, &batch, list) {
+			if (req->mm != mm) {
+				if (mm)
+					unuse_mm(mm);
+				mm = req->mm;
+				if (mm)
+					use_mm(mm);
+			}
+			req->result = sculld_do_iter(req->write, req->iocb, &req->iter);
+		}
+		if (mm)
+			unuse_mm(mm);
+
+		list_for_each_entry_safe(req, next, &batch, list) {
+			list_del(&req->list);
+			req->iocb->ki_complete(req->iocb, req->result, 0);
+			if (req->mm)
+				mmput(req->mm);
+			kfree(req->iov);
+			kfree(req);
+		}
+		spin_lock(&dev->aio_lock);
+		dev->aio_depth -= n;
+		spin_unlock(&dev->aio_lock);
 	}
+}
 
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
+static ssize_t sculld_defer_op(int write, struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+	struct sculld_aio *req;
 
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_DELAYED_WORK(&stuff->work, sculld_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
+	/*
+	 * Pipes are only ever spliced synchronously; an iovec needs the
+	 * submitter's mm to be reachable from the worker.
+	 */
+	if (is_sync_kiocb(iocb) || (iter->type & ITER_PIPE) ||
+			(iter_is_iovec(iter) && !current->mm))
+		return sculld_do_iter(write, iocb, iter);
+
+	/* reserve a slot; a full queue means the caller does the work */
+	spin_lock(&dev->aio_lock);
+	if (dev->aio_depth >= sculld_aio_depth) {
+		spin_unlock(&dev->aio_lock);
+		return sculld_do_iter(write, iocb, iter);
+	}
+	dev->aio_depth++;
+	spin_unlock(&dev->aio_lock);
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (req)
+		req->iov = dup_iter(&req->iter, iter, GFP_KERNEL);
+	if (!req || !req->iov) {
+		kfree(req);
+		spin_lock(&dev->aio_lock);
+		dev->aio_depth--;
+		spin_unlock(&dev->aio_lock);
+		return sculld_do_iter(write, iocb, iter);
+	}
+	req->iocb = iocb;
+	req->write = write;
+	req->mm = iter_is_iovec(iter) ? current->mm : NULL;
+	if (req->mm)
+		atomic_inc(&req->mm->mm_users);
+
+	spin_lock(&dev->aio_lock);
+	list_add_tail(&req->list, &dev->aio_queue);
+	spin_unlock(&dev->aio_lock);
+	queue_work(sculld_wq, &dev->aio_work);
 	return -EIOCBQUEUED;
 }
 
+
 static ssize_t sculld_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
 	return sculld_defer_op(0, iocb, iter);
@@ -488,17 +659,34 @@ struct file_operations sculld_fops = {
 	.release =   sculld_release,
         .read_iter = sculld_read_iter,
         .write_iter = sculld_write_iter,
+        .splice_read = generic_file_splice_read,
+        .splice_write = iter_file_splice_write,
 };
 
 int sculld_trim(struct sculld_dev *dev)
 {
 	struct sculld_dev *next, *dptr;
 	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
+	unsigned long base;
+	int i, indexed = 0;
 
 	if (dev->vmas) /* don't trim: there are active mappings */
 		return -EBUSY;
 
+	/*
+	 * Take the quanta out of the fault path's index first, and give
+	 * any fault that found one there the time to take its reference.
+	 */
+	for (dptr = dev, base = 0; dptr; dptr = dptr->next, base += qset) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < qset; i++)
+			if (dptr->data[i] && radix_tree_delete(&dev->quanta, base + i))
+				indexed = 1;
+	}
+	if (indexed)
+		synchronize_rcu();
+
 	for (dptr = dev; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			/* This code frees a whole quantum-set */
@@ -575,6 +763,13 @@ int sculld_init(void)
 	if (result < 0)
 		return result;
 
+	/* one unbound workqueue serves the aio of all devices */
+	sculld_wq = alloc_workqueue("sculld_aio", WQ_UNBOUND, 0);
+	if (!sculld_wq) {
+		result = -ENOMEM;
+		goto fail_malloc;
+	}
+
 	/*
 	 * Register with the driver core.
 	 */
@@ -594,6 +789,10 @@ int sculld_init(void)
 		sculld_devices[i].order = sculld_order;
 		sculld_devices[i].qset = sculld_qset;
 		sema_init (&sculld_devices[i].sem, 1);
+		INIT_RADIX_TREE(&sculld_devices[i].quanta, GFP_KERNEL);
+		spin_lock_init(&sculld_devices[i].aio_lock);
+		INIT_LIST_HEAD(&sculld_devices[i].aio_queue);
+		INIT_WORK(&sculld_devices[i].aio_work, sculld_aio_work);
 		sculld_setup_cdev(sculld_devices + i, i);
 		sculld_register_dev(sculld_devices + i, i);
 	}
@@ -605,6 +804,8 @@ int sculld_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	if (sculld_wq)
+		destroy_workqueue(sculld_wq);
 	unregister_chrdev_region(dev, sculld_devs);
 	return result;
 }
@@ -619,6 +820,9 @@ void sculld_cleanup(void)
 	remove_proc_entry("sculldmem", NULL);
 #endif
 
+	if (sculld_wq)
+		destroy_workqueue(sculld_wq); /* waits for any queued aio */
+
 	for (i = 0; i < sculld_devs; i++) {
 		unregister_ldd_device(&sculld_devices[i].ldev);
 		cdev_del(&sculld_devices[i].cdev);
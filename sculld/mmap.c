@@ -19,6 +19,8 @@
 #include <linux/fs.h>
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
 #include <asm/pgtable.h>
 
 #include "sculld.h"		/* local definitions */
@@ -54,41 +56,41 @@ void sculld_vma_close(struct vm_area_struct *vma)
  * release it as a whole block. Therefore, it isn't possible to map
  * pages from a multipage block: when they are unmapped, their count
  * is individually decreased, and would drop to 0.
+ *
+ * The semaphore is not taken, and the list is not walked: the quantum
+ * is found in the device's radix tree under RCU, and its page counted
+ * before the read-side section ends.  Trim takes quanta out of the
+ * tree and waits for a grace period before freeing them.  Holes, and
+ * anything past the end of the device, get SIGBUS.
+ *
+ * The two-argument fault() and vmf->virtual_address go away in 4.11,
+ * and main.c's pipe iterators arrive in 4.9: build for 4.9 or 4.10.
  */
 
 static int sculld_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
+	struct sculld_dev *dev = vma->vm_private_data;
+	unsigned long quantum = PAGE_SIZE << dev->order;
 	unsigned long offset;
-	struct sculld_dev *ptr, *dev = vma->vm_private_data;
 	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
-	int retval = VM_FAULT_NOPAGE;
+	void *pageptr;
 
-	down(&dev->sem);
 	offset = (unsigned long)(vmf->virtual_address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the sculld device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	if (offset >= READ_ONCE(dev->size))
+		return VM_FAULT_SIGBUS; /* out of range */
+
+	rcu_read_lock();
+	pageptr = radix_tree_lookup(&dev->quanta, offset / quantum);
+	if (pageptr) {
+		page = virt_to_page(pageptr + ((offset % quantum) & PAGE_MASK));
+		get_page(page);
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
+	rcu_read_unlock();
+	if (!page)
+		return VM_FAULT_SIGBUS; /* a hole */
 
-	/* got it, now increment the count */
-	get_page(page);
 	vmf->page = page;
-	retval = 0;
-
-  out:
-	up(&dev->sem);
-	return retval;
+	return 0;
 }
 
 
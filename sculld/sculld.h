@@ -15,6 +15,8 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/workqueue.h>
+#include <linux/radix-tree.h>
 #include <linux/device.h>
 #include "../include/lddbus.h"
 
@@ -42,6 +44,13 @@
 
 #define SCULLD_DEVS 4    /* sculld0 through sculld3 */
 
+/*
+ * Asynchronous requests: how many a device keeps queued for its
+ * worker, and how many the worker serves before completing them.
+ */
+#define SCULLD_AIO_DEPTH 64
+#define SCULLD_AIO_BATCH 16
+
 /*
  * The bare device is a variable-length region of memory.
  * Use a linked list of indirect blocks.
@@ -61,7 +70,12 @@ struct sculld_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct radix_tree_root quanta; /* quanta by number, for faults */
 	struct semaphore sem;     /* Mutual exclusion */
+	spinlock_t aio_lock;      /* protects the aio queue and depth */
+	struct list_head aio_queue; /* requests waiting for the worker */
+	int aio_depth;            /* queued or being served */
+	struct work_struct aio_work;
 	struct cdev cdev;
 	char devname[20];
 	struct ldd_device ldev;
@@ -78,6 +92,7 @@ extern int sculld_major;     /* main.c */
 extern int sculld_devs;
 extern int sculld_order;
 extern int sculld_qset;
+extern int sculld_aio_depth;
 
 /*
  * Prototypes for shared functions
@@ -19,6 +19,9 @@
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/log2.h>	/* roundup_pow_of_two() */
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
 #include <asm/pgtable.h>
 #include <linux/fs.h>
 
@@ -46,50 +49,76 @@ void scullp_vma_close(struct vm_area_struct *vma)
 
 /*
  * The nopage method: the core of the file. It retrieves the
- * page required from the scullp device and returns it to the
- * user. The count for the page must be incremented, because
- * it is automatically decremented at page unmap.
+ * page required from the scullp device and maps it for the user.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * Quanta are compound pages, so any page of a multipage block can be
+ * mapped by itself: vm_insert_page() takes its reference on the head,
+ * and the block is only freed once the last mapping is gone.
+ *
+ * Rather than one page per fault, map the whole aligned window of
+ * scullp_fault_around pages (at least one quantum) around the fault:
+ * populating a large mapping then takes one fault per window.  Holes
+ * are left unmapped, and touching one, or anything past the end of
+ * the device, sends SIGBUS.
+ *
+ * The semaphore is not taken: quanta are found in the device's
+ * radix tree under RCU, and pinned there with a reference on their
+ * head page before anything can sleep.  Trim takes them out of the
+ * tree and waits for a grace period before freeing them, so faults
+ * neither wait for reads and writes nor for each other.
+ *
+ * Like main.c, this is written for 4.9 and 4.10: fault() still gets
+ * the vma, and the faulting address is vmf->virtual_address.
  */
 
 static int scullp_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	unsigned long offset;
-	struct scullp_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
-	int retval = VM_FAULT_NOPAGE;
-
-	down(&dev->sem);
-	offset = (unsigned long)(vmf->virtual_address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the scullp device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	struct scullp_dev *dev = vma->vm_private_data;
+	unsigned long address = (unsigned long)vmf->virtual_address & PAGE_MASK;
+	unsigned long quantum = PAGE_SIZE << dev->order;
+	unsigned long window, start, end, addr, offset, size, step, i;
+	struct page *head = NULL;
+	void *qptr;
+	int err, retval = VM_FAULT_SIGBUS;
+
+	window = roundup_pow_of_two(max_t(unsigned long, scullp_fault_around, 1)) << PAGE_SHIFT;
+	if (window < quantum)
+		window = quantum;
+	start = max(address & ~(window - 1), vma->vm_start);
+	end = min(start + window, vma->vm_end);
+
+	offset = start - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT);
+	size = READ_ONCE(dev->size);
+	if (address - start + offset >= size)
+		return VM_FAULT_SIGBUS; /* out of range */
+	end = min(end, start + PAGE_ALIGN(size - offset));
+
+	for (addr = start; addr < end; addr += step, offset += step) {
+		step = min(end - addr, quantum - offset % quantum);
+
+		rcu_read_lock();
+		qptr = radix_tree_lookup(&dev->quanta, offset / quantum);
+		if (qptr) {
+			head = virt_to_page(qptr);
+			get_page(head);
+		}
+		rcu_read_unlock();
+		if (!qptr)
+			continue; /* a hole */
+
+		qptr += offset % quantum;
+		for (i = 0; i < step; i += PAGE_SIZE) {
+			err = vm_insert_page(vma, addr + i, virt_to_page(qptr + i));
+			if (addr + i != address)
+				continue;
+			/* -EBUSY: someone else mapped it already */
+			if (!err || err == -EBUSY)
+				retval = VM_FAULT_NOPAGE;
+			else if (err == -ENOMEM)
+				retval = VM_FAULT_OOM;
+		}
+		put_page(head);
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-	vmf->page = page;
-	retval = 0;
-
-  out:
-	up(&dev->sem);
 	return retval;
 }
 
@@ -104,16 +133,11 @@ struct vm_operations_struct scullp_vm_ops = {
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_path.dentry->d_inode;
-
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
-
 	/* don't do anything here: "nopage" will set up page table entries */
 	vma->vm_ops = &scullp_vm_ops;
 	//vma->vm_flags |= VM_RESERVED; this flag is no longer exist after kernel 3.7
 	vma->vm_flags |= VM_DONTDUMP;
+	vma->vm_flags |= VM_MIXEDMAP; /* vm_insert_page() from the fault */
 	vma->vm_flags |= VM_DONTEXPAND;
 	vma->vm_private_data = filp->private_data;
 	scullp_vma_open(vma);
@@ -15,6 +15,8 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/workqueue.h>
+#include <linux/radix-tree.h>
 #include <linux/semaphore.h>
 
 /*
@@ -41,6 +43,13 @@
 
 #define SCULLP_DEVS 4    /* scullp0 through scullp3 */
 
+/*
+ * Asynchronous requests: how many a device keeps queued for its
+ * worker, and how many the worker serves before completing them.
+ */
+#define SCULLP_AIO_DEPTH 64
+#define SCULLP_AIO_BATCH 16
+
 /*
  * The bare device is a variable-length region of memory.
  * Use a linked list of indirect blocks.
@@ -53,6 +62,12 @@
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
+/*
+ * A page fault on a mapping maps this many pages around the faulting
+ * one (rounded up to a power of two, and to at least one quantum).
+ */
+#define SCULLP_FAULT_AROUND 512
+
 struct scullp_dev {
 	void **data;
 	struct scullp_dev *next;  /* next listitem */
@@ -60,7 +75,12 @@ struct scullp_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct radix_tree_root quanta; /* quanta by number, for faults */
 	struct semaphore sem;     /* Mutual exclusion */
+	spinlock_t aio_lock;      /* protects the aio queue and depth */
+	struct list_head aio_queue; /* requests waiting for the worker */
+	int aio_depth;            /* queued or being served */
+	struct work_struct aio_work;
 	struct cdev cdev;
 };
 
@@ -75,6 +95,8 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_fault_around;
+extern int scullp_aio_depth;
 
 /*
  * Prototypes for shared functions
@@ -26,6 +26,13 @@
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/uio.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/workqueue.h>
+#include <linux/mmu_context.h>	/* use_mm() */
+#include <linux/sched.h>	/* mmput() */
 #include <asm/uaccess.h>
 #include <linux/vmalloc.h>
 #include <linux/seq_file.h>
@@ -36,11 +43,13 @@ int scullv_major =   SCULLV_MAJOR;
 int scullv_devs =    SCULLV_DEVS;	/* number of bare scullv devices */
 int scullv_qset =    SCULLV_QSET;
 int scullv_order =   SCULLV_ORDER;
+int scullv_aio_depth = SCULLV_AIO_DEPTH;	/* per-device aio queue bound */
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_aio_depth, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -177,6 +186,7 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 		if (!dev->next) {
 			dev->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
 			memset(dev->next, 0, sizeof(struct scullv_dev));
+			dev->next->order = dev->order; /* same quanta throughout */
 		}
 		dev = dev->next;
 		continue;
@@ -184,6 +194,36 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 	return dev;
 }
 
+/*
+ * Allocate quantum "s_pos" of listitem "dptr", which is quantum number
+ * "index" of the device, and enter it in the device's quanta tree.
+ * The mmap fault path looks quanta up in the tree under RCU alone, so
+ * the memory is cleared before it is published there.
+ */
+static void *scullv_new_quantum(struct scullv_dev *dev, struct scullv_dev *dptr,
+		int s_pos, unsigned long index)
+{
+	void *quantum;
+
+	quantum = vmalloc(PAGE_SIZE << dptr->order);
+	if (!quantum)
+		return NULL;
+	memset(quantum, 0, PAGE_SIZE << dptr->order);
+	if (radix_tree_preload(GFP_KERNEL))
+		goto fail;
+	if (radix_tree_insert(&dev->quanta, index, quantum)) {
+		radix_tree_preload_end();
+		goto fail;
+	}
+	radix_tree_preload_end();
+	dptr->data[s_pos] = quantum;
+	return quantum;
+
+  fail:
+	vfree(quantum);
+	return NULL;
+}
+
 /*
  * Data management: read and write
  */
@@ -263,13 +303,10 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 			goto nomem;
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
-	/* Allocate a quantum using virtual addresses */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
+	/* Here's the allocation of a single quantum */
+	if (!dptr->data[s_pos] &&
+			!scullv_new_quantum(dev, dptr, s_pos, (unsigned long) item * qset + s_pos))
+		goto nomem;
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
 	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
@@ -415,60 +452,196 @@ loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
 
 
 /*
- * A simple asynchronous I/O implementation.
+ * Asynchronous I/O.  Each device queues up to scullv_aio_depth
+ * requests for a work item that does the copy off the submitter's
+ * thread, running on the submitter's mm, and completes each batch
+ * of iocbs as soon as their data has moved.  Synchronous iocbs, and
+ * those that find the queue full, are served inline.
  */
 
-struct async_work {
+static struct workqueue_struct *scullv_wq;
+
+struct scullv_aio {
+	struct list_head list;
 	struct kiocb *iocb;
-	int result;
-	struct delayed_work work;
+	struct iov_iter iter;     /* our copy of the caller's iterator */
+	const void *iov;          /* and of its segment array */
+	struct mm_struct *mm;     /* the address space of an iovec */
+	int write;
+	ssize_t result;
 };
 
 /*
- * "Complete" an asynchronous operation.
+ * Move data between the device and any kind of iterator: user iovecs,
+ * kernel kvecs, page bvecs or a pipe.  The whole request walks the
+ * quanta under a single hold of the semaphore.
  */
-static void scullv_do_deferred_op(struct work_struct *work)
+static ssize_t scullv_do_iter(int write, struct kiocb *iocb, struct iov_iter *iter)
 {
-	struct async_work *stuff = container_of(work, struct async_work, work.work);
-        stuff->iocb->ki_complete(stuff->iocb, stuff->result, 0);
-	kfree(stuff);
-}
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+	struct scullv_dev *dptr;
+	int quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+	int s_pos, q_pos, rest;
+	loff_t pos = iocb->ki_pos;
+	size_t count, chunk, copied, done = 0;
+	ssize_t retval = 0;
 
-static int scullv_defer_op(int write, struct kiocb *iocb, struct iov_iter* iter)
-{
-	struct async_work *stuff;
-	int result = 0;
-	size_t len = 0;
-	unsigned long seg = 0;
+	if (down_interruptible (&dev->sem))
+		return -ERESTARTSYS;
+	count = iov_iter_count(iter);
+	if (!write) {
+		if (pos >= dev->size)
+			goto out;
+		if (count > dev->size - pos)
+			count = dev->size - pos;
+	}
+	if (!count)
+		goto out;
 
-	/* Copy now while we can access the buffer */
-	for (seg = 0; seg < iter->nr_segs; seg++) {
+	dptr = scullv_follow(dev, ((long) pos) / itemsize);
+	rest = ((long) pos) % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	while (count) {
+		if (write) {
+			if (!dptr->data) {
+				dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+				if (!dptr->data) {
+					retval = -ENOMEM;
+					break;
+				}
+				memset(dptr->data, 0, qset * sizeof(char *));
+			}
+			if (!dptr->data[s_pos] &&
+					!scullv_new_quantum(dev, dptr, s_pos, ((long) pos) / quantum)) {
+				retval = -ENOMEM;
+				break;
+			}
+		} else if (!dptr->data || !dptr->data[s_pos])
+			break; /* don't fill holes */
+
+		chunk = min_t(size_t, count, quantum - q_pos);
 		if (write)
-			len = scullv_write(iocb->ki_filp, iter->iov[seg].iov_base, iter->iov[seg].iov_len, &iocb->ki_pos);
+			copied = copy_from_iter(dptr->data[s_pos] + q_pos, chunk, iter);
 		else
-			len = scullv_read(iocb->ki_filp, iter->iov[seg].iov_base, iter->iov[seg].iov_len, &iocb->ki_pos);
+			copied = copy_to_iter(dptr->data[s_pos] + q_pos, chunk, iter);
+		pos += copied;
+		done += copied;
+		count -= copied;
+		if (copied < chunk) {
+			retval = -EFAULT;
+			break;
+		}
 
-		if (len < 0)
-			return len;
+		/* on to the next quantum, and maybe the next listitem */
+		q_pos = 0;
+		if (count && ++s_pos == qset) {
+			s_pos = 0;
+			dptr = scullv_follow(dptr, 1);
+		}
+	}
+	if (write && dev->size < pos)
+		dev->size = pos;
+	iocb->ki_pos = pos;
+
+  out:
+	up (&dev->sem);
+	return done ? done : retval;
+}
 
-		result += len;
+static void scullv_aio_work(struct work_struct *work)
+{
+	struct scullv_dev *dev = container_of(work, struct scullv_dev, aio_work);
+	struct scullv_aio *req, *next;
+	struct mm_struct *mm;
+	LIST_HEAD(batch);
+	int n;
+
+	for (;;) {
+		spin_lock(&dev->aio_lock);
+		for (n = 0; n < SCULLV_AIO_BATCH && !list_empty(&dev->aio_queue); n++)
+			list_move_tail(dev->aio_queue.next, &batch);
+		spin_unlock(&dev->aio_lock);
+		if (!n)
+			break;
+
+		/* requests from one process come in runs: switch mm rarely */
+		mm = NULL;
+		list_for_each_entry(req, &batch, list) {
+			if (req->mm != mm) {
+				if (mm)
+					unuse_mm(mm);
+				mm = req->mm;
+				if (mm)
+					use_mm(mm);
+			}
+			req->result = scullv_do_iter(req->write, req->iocb, &req->iter);
+		}
+		if (mm)
+			unuse_mm(mm);
+
+		list_for_each_entry_safe(req, next, &batch, list) {
+			list_del(&req->list);
+			req->iocb->ki_complete(req->iocb, req->result, 0);
+			if (req->mm)
+				mmput(req->mm);
+			kfree(req->iov);
+			kfree(req);
+		}
+		spin_lock(&dev->aio_lock);
+		dev->aio_depth -= n;
+		spin_unlock(&dev->aio_lock);
 	}
+}
 
-	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb))
-		return result;
+static ssize_t scullv_defer_op(int write, struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+	struct scullv_aio *req;
 
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
-	if (stuff == NULL)
-		return result; /* No memory, just complete now */
-	stuff->iocb = iocb;
-	stuff->result = result;
-	INIT_DELAYED_WORK(&stuff->work, scullv_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
+	/*
+	 * Pipes are only ever spliced synchronously; an iovec needs the
+	 * submitter's mm to be reachable from the worker.
+	 */
+	if (is_sync_kiocb(iocb) || (iter->type & ITER_PIPE) ||
+			(iter_is_iovec(iter) && !current->mm))
+		return scullv_do_iter(write, iocb, iter);
+
+	/* reserve a slot; a full queue means the caller does the work */
+	spin_lock(&dev->aio_lock);
+	if (dev->aio_depth >= scullv_aio_depth) {
+		spin_unlock(&dev->aio_lock);
+		return scullv_do_iter(write, iocb, iter);
+	}
+	dev->aio_depth++;
+	spin_unlock(&dev->aio_lock);
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (req)
+		req->iov = dup_iter(&req->iter, iter, GFP_KERNEL);
+	if (!req || !req->iov) {
+		kfree(req);
+		spin_lock(&dev->aio_lock);
+		dev->aio_depth--;
+		spin_unlock(&dev->aio_lock);
+		return scullv_do_iter(write, iocb, iter);
+	}
+	req->iocb = iocb;
+	req->write = write;
+	req->mm = iter_is_iovec(iter) ? current->mm : NULL;
+	if (req->mm)
+		atomic_inc(&req->mm->mm_users);
+
+	spin_lock(&dev->aio_lock);
+	list_add_tail(&req->list, &dev->aio_queue);
+	spin_unlock(&dev->aio_lock);
+	queue_work(scullv_wq, &dev->aio_work);
 	return -EIOCBQUEUED;
 }
 
+
 static ssize_t scullv_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
 	return scullv_defer_op(0, iocb, iter);
@@ -479,6 +652,102 @@ static ssize_t scullv_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 	return scullv_defer_op(1, iocb, iter);
 }
 
+/* nosteal_pipe_buf_ops is not exported to modules: the same, here */
+static int scullv_buf_nosteal(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf)
+{
+	return 1;
+}
+
+static const struct pipe_buf_operations scullv_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = scullv_buf_nosteal,
+	.get = generic_pipe_buf_get,
+};
+
+static void scullv_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * splice_read lends the device pages to the pipe, with a reference
+ * of its own on each: nothing is copied, and a trim while the data
+ * sits in the pipe only drops our references.  Like vmsplice, a later
+ * write to the same offsets shows through to whoever has not yet
+ * consumed the pipe.  Splicing into a device (iter_file_splice_write)
+ * copies once, through write_iter, so device to device through a pipe
+ * costs a single copy.
+ */
+static ssize_t scullv_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scullv_dev *dev = filp->private_data;
+	struct scullv_dev *dptr;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &scullv_pipe_buf_ops,
+		.spd_release = scullv_spd_release,
+	};
+	int quantum = PAGE_SIZE << dev->order;
+	int qset = dev->qset;
+	int itemsize = quantum * qset;
+	int s_pos, q_pos, rest, off;
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	if (down_interruptible (&dev->sem))
+		return -ERESTARTSYS;
+	if (pos >= dev->size) {
+		up (&dev->sem);
+		return 0;
+	}
+	if (len > dev->size - pos)
+		len = dev->size - pos;
+
+	dptr = scullv_follow(dev, ((long) pos) / itemsize);
+	rest = ((long) pos) % itemsize;
+	s_pos = rest / quantum; q_pos = rest % quantum;
+
+	while (len && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		struct page *page;
+
+		if (!dptr->data || !dptr->data[s_pos])
+			break; /* don't fill holes */
+		page = vmalloc_to_page(dptr->data[s_pos] + (q_pos & PAGE_MASK));
+		off = q_pos & ~PAGE_MASK;
+		get_page(page);
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = off;
+		partial[spd.nr_pages].len = min_t(size_t, len, PAGE_SIZE - off);
+		len -= partial[spd.nr_pages].len;
+		q_pos += partial[spd.nr_pages].len;
+		spd.nr_pages++;
+
+		if (q_pos == quantum) {
+			q_pos = 0;
+			if (len && ++s_pos == qset) {
+				s_pos = 0;
+				dptr = scullv_follow(dptr, 1);
+			}
+		}
+	}
+	up (&dev->sem);
+
+	if (!spd.nr_pages)
+		return 0;
+	ret = splice_to_pipe(pipe, &spd); /* releases what did not fit */
+	if (ret > 0)
+		*ppos += ret;
+	return ret;
+}
+
 
  
 /*
@@ -502,17 +771,34 @@ struct file_operations scullv_fops = {
 	.release =   scullv_release,
 	.read_iter =  scullv_read_iter,
 	.write_iter = scullv_write_iter,
+	.splice_read = scullv_splice_read,
+	.splice_write = iter_file_splice_write,
 };
 
 int scullv_trim(struct scullv_dev *dev)
 {
 	struct scullv_dev *next, *dptr;
 	int qset = dev->qset;   /* "dev" is not-null */
-	int i;
+	unsigned long base;
+	int i, indexed = 0;
 
 	if (dev->vmas) /* don't trim: there are active mappings */
 		return -EBUSY;
 
+	/*
+	 * Take the quanta out of the fault path's index first, and give
+	 * any fault that found one there the time to take its reference.
+	 */
+	for (dptr = dev, base = 0; dptr; dptr = dptr->next, base += qset) {
+		if (!dptr->data)
+			continue;
+		for (i = 0; i < qset; i++)
+			if (dptr->data[i] && radix_tree_delete(&dev->quanta, base + i))
+				indexed = 1;
+	}
+	if (indexed)
+		synchronize_rcu();
+
 	for (dptr = dev; dptr; dptr = next) { /* all the list items */
 		if (dptr->data) {
 			/* Release the quantum-set */
@@ -570,6 +856,13 @@ int scullv_init(void)
 	if (result < 0)
 		return result;
 
+	/* one unbound workqueue serves the aio of all devices */
+	scullv_wq = alloc_workqueue("scullv_aio", WQ_UNBOUND, 0);
+	if (!scullv_wq) {
+		result = -ENOMEM;
+		goto fail_malloc;
+	}
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -585,6 +878,10 @@ int scullv_init(void)
 		scullv_devices[i].order = scullv_order;
 		scullv_devices[i].qset = scullv_qset;
 		sema_init (&scullv_devices[i].sem, 1);
+		INIT_RADIX_TREE(&scullv_devices[i].quanta, GFP_KERNEL);
+		spin_lock_init(&scullv_devices[i].aio_lock);
+		INIT_LIST_HEAD(&scullv_devices[i].aio_queue);
+		INIT_WORK(&scullv_devices[i].aio_work, scullv_aio_work);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
@@ -595,6 +892,8 @@ int scullv_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	if (scullv_wq)
+		destroy_workqueue(scullv_wq);
 	unregister_chrdev_region(dev, scullv_devs);
 	return result;
 }
@@ -609,6 +908,9 @@ void scullv_cleanup(void)
 	remove_proc_entry("scullvmem", NULL);
 #endif
 
+	if (scullv_wq)
+		destroy_workqueue(scullv_wq); /* waits for any queued aio */
+
 	for (i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
 		scullv_trim(scullv_devices + i);
@@ -19,6 +19,8 @@
 
 #include <linux/mm.h>		/* everything */
 #include <linux/errno.h>	/* error codes */
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
 #include <asm/pgtable.h>
 #include <linux/fs.h>
 
@@ -50,53 +52,44 @@ void scullv_vma_close(struct vm_area_struct *vma)
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * Each page of a vmalloc'ed quantum is a page of its own, whatever
+ * the order, so vmalloc_to_page() gives one that can be mapped and
+ * counted by itself.
+ *
+ * The semaphore is not taken, and the list is not walked: the quantum
+ * is found in the device's radix tree under RCU, and its page counted
+ * before the read-side section ends.  Trim takes quanta out of the
+ * tree and waits for a grace period before freeing them.  Holes, and
+ * anything past the end of the device, get SIGBUS.
+ *
+ * fault(vma, vmf) and vmf->virtual_address tie this to 4.10 and
+ * earlier; main.c needs 4.9 for pipe iterators.
  */
 
 static int scullv_vma_nopage(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
+	struct scullv_dev *dev = vma->vm_private_data;
+	unsigned long quantum = PAGE_SIZE << dev->order;
 	unsigned long offset;
-	struct scullv_dev *ptr, *dev = vma->vm_private_data;
 	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
-	int retval = VM_FAULT_NOPAGE;
+	void *pageptr;
 
-	down(&dev->sem);
 	offset = (unsigned long)(vmf->virtual_address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
-
-	/*
-	 * Now retrieve the scullv device from the list,then the page.
-	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
-	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	if (offset >= READ_ONCE(dev->size))
+		return VM_FAULT_SIGBUS; /* out of range */
+
+	rcu_read_lock();
+	pageptr = radix_tree_lookup(&dev->quanta, offset / quantum);
+	if (pageptr) {
+		page = vmalloc_to_page(pageptr + ((offset % quantum) & PAGE_MASK));
+		get_page(page);
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-
-	/*
-	 * After scullv lookup, "page" is now the address of the page
-	 * needed by the current process. Since it's a vmalloc address,
-	 * turn it into a struct page.
-	 */
-	page = vmalloc_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-	vmf->page = page;
-	retval = 0;
+	rcu_read_unlock();
+	if (!page)
+		return VM_FAULT_SIGBUS; /* a hole */
 
-  out:
-	up(&dev->sem);
-	return retval;
+	vmf->page = page;
+	return 0;
 }
 
 
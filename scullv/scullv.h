@@ -15,6 +15,8 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/workqueue.h>
+#include <linux/radix-tree.h>
 #include <linux/semaphore.h>
 
 /*
@@ -41,6 +43,13 @@
 
 #define SCULLV_DEVS 4    /* scullv0 through scullv3 */
 
+/*
+ * Asynchronous requests: how many a device keeps queued for its
+ * worker, and how many the worker serves before completing them.
+ */
+#define SCULLV_AIO_DEPTH 64
+#define SCULLV_AIO_BATCH 16
+
 /*
  * The bare device is a variable-length region of memory.
  * Use a linked list of indirect blocks.
@@ -60,7 +69,12 @@ struct scullv_dev {
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	struct radix_tree_root quanta; /* quanta by number, for faults */
 	struct semaphore sem;     /* Mutual exclusion */
+	spinlock_t aio_lock;      /* protects the aio queue and depth */
+	struct list_head aio_queue; /* requests waiting for the worker */
+	int aio_depth;            /* queued or being served */
+	struct work_struct aio_work;
 	struct cdev cdev;
 };
 
@@ -75,6 +89,7 @@ extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
 extern int scullv_qset;
+extern int scullv_aio_depth;
 
 /*
  * Prototypes for shared functions
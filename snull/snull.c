@@ -32,6 +32,42 @@
 #include <linux/ip.h>          /* struct iphdr */
 #include <linux/tcp.h>         /* struct tcphdr */
 #include <linux/skbuff.h>
+#include <linux/ethtool.h>
+#include <linux/log2.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/random.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
+
+/*
+ * Native XDP, with the ndo_xdp_xmit that goes with it, needs 4.18.
+ * The driver as a whole stops at 5.5: ndo_tx_timeout loses its
+ * one-argument form in 5.6, XDP_QUERY_PROG goes in 5.9 and the
+ * xsk_umem calls in 5.10.  So there is no xdp_buff.frame_sz (5.8)
+ * to fill in, and bpf_xdp_adjust_tail works from the data alone.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+#define SNULL_XDP
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>
+#include <linux/filter.h>
+#include <net/xdp.h>
+#endif
+
+/*
+ * AF_XDP zero-copy transmission, with the API of 5.4 and later.
+ * Older kernels still get copy-mode AF_XDP through XDP_REDIRECT.
+ */
+#if defined(SNULL_XDP) && IS_ENABLED(CONFIG_XDP_SOCKETS) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+#define SNULL_XSK
+#define SNULL_XSK_MAX	256	/* AF_XDP frames in flight per queue */
+#include <linux/delay.h>
+#include <net/xdp_sock.h>
+#endif
 
 #include "snull.h"
 
@@ -57,63 +93,268 @@ module_param(timeout, int, 0);
 static int use_napi = 0;
 module_param(use_napi, int, 0);
 
+/*
+ * How many packets a NAPI poll may take at once.
+ */
+static int napi_weight = NAPI_POLL_WEIGHT;
+module_param(napi_weight, int, 0);
+
+/*
+ * Zero-copy mode: the transmitted skb itself is handed to the twin,
+ * instead of being copied into a pool buffer and again into a new
+ * skb on the other side.
+ */
+static int zerocopy = 0;
+module_param(zerocopy, int, 0);
+
+/*
+ * The largest MTU the copy mode is ready for: it sizes the packet
+ * buffers.  Zero-copy mode takes anything up to SNULL_MAX_MTU.
+ */
+#define SNULL_MAX_MTU	65535
+static int max_mtu = ETH_DATA_LEN;
+module_param(max_mtu, int, 0);
+
+/*
+ * Slots in each receive ring; rounded up to a power of two.
+ */
+static int ring_size = 256;
+module_param(ring_size, int, 0);
+
+
+/*
+ * How many TX/RX queue pairs each interface has; zero means one per
+ * CPU.  The stack spreads flows over the TX queues by their hash, and
+ * each TX queue delivers to the RX queue with the same number on the
+ * twin, so a flow stays on one queue end to end.
+ */
+static int nr_queues = 0;
+module_param(nr_queues, int, 0);
+
+/*
+ * How many interfaces.  Two are the classic twins, each one the other
+ * end of the wire, the addresses rewritten on the way.  More than two
+ * are plugged into a learning switch and act like ordinary Ethernet
+ * ports, with ARP and all: put them in network namespaces of their
+ * own to make them separate hosts.
+ */
+static int nr_devs = 2;
+module_param(nr_devs, int, 0);
+
+/*
+ * Link emulation, between the sender and the receive ring of the
+ * twin: a fixed delay plus up to "jitter" either way, a bandwidth,
+ * and the probabilities (in parts per million) of losing a packet or
+ * letting it jump the queue.  These are the defaults for both
+ * interfaces; /sys/class/net/snX/snull/ has them for each.  "limit"
+ * is the number of packets a queue can hold on the wire.
+ */
+static unsigned int emu_latency_us = 0;
+module_param(emu_latency_us, uint, 0);
+static unsigned int emu_jitter_us = 0;
+module_param(emu_jitter_us, uint, 0);
+static unsigned int emu_rate_kbit = 0;
+module_param(emu_rate_kbit, uint, 0);
+static unsigned int emu_loss_ppm = 0;
+module_param(emu_loss_ppm, uint, 0);
+static unsigned int emu_reorder_ppm = 0;
+module_param(emu_reorder_ppm, uint, 0);
+static unsigned int emu_limit = 1000;
+module_param(emu_limit, uint, 0);
+
 
 static unsigned long trans_start;
 
 /*
- * A structure representing an in-flight packet.
+ * A structure representing an in-flight packet.  The frame starts
+ * some way into the buffer, leaving room for an XDP program to grow
+ * its head.
  */
+#ifdef SNULL_XDP
+#define SNULL_HEADROOM	XDP_PACKET_HEADROOM
+#else
+#define SNULL_HEADROOM	0
+#endif
+
 struct snull_packet {
 	struct snull_packet *next;
-	struct net_device *dev;
+	struct snull_pool *pool;	/* Where it goes back when done */
 	int	datalen;
-	u8 data[ETH_DATA_LEN];
+	u64	tick;		/* When it leaves the emulated link */
+	u8 *data;		/* The frame, somewhere in buf */
+#ifdef SNULL_XSK
+	struct snull_queue *xsk;	/* data is an AF_XDP frame of this queue */
+	unsigned int xsk_seq;		/* ...and its place in that queue's sends */
+#endif
+	u8 buf[];		/* SNULL_HEADROOM + ETH_HLEN + max_mtu bytes */
 };
 
-int pool_size = 8;
+/*
+ * Packets come from per-CPU pools, so that transmitting on different
+ * CPUs never touches the same lock.  A packet goes back to the pool it
+ * came from, wherever it is released; with link emulation that is
+ * only after the delay, so the pools must cover what is on the wire.
+ */
+int pool_size = 8;	/* Packets per CPU */
 module_param(pool_size, int, 0);
 
+struct snull_pool {
+	spinlock_t lock;
+	struct snull_packet *ppool;
+	struct net_device *dev;
+	int dry;			/* Ran out and stopped the queues */
+};
+
 /*
- * This structure is private to each device. It is used to pass
- * packets in and out, so there is place for a packet
+ * Interrupt coalescing, one for each direction of a queue: the
+ * interrupt is held back until enough events pile up, or the timer
+ * runs out, whichever comes first.
+ */
+struct snull_coal {
+	struct hrtimer timer;
+	unsigned int events;		/* Since the last interrupt */
+	int intr;			/* SNULL_RX_INTR or SNULL_TX_INTR */
+	struct snull_queue *q;
+};
+
+/*
+ * The emulated link of a queue is a timing wheel: a packet waits in
+ * the slot of the tick it is due, an hrtimer set for the next busy
+ * slot.  Slots hold packets of later turns of the wheel too, which
+ * stay until their own tick comes.  Packets are chained through their
+ * "next" pointer; in zero-copy mode they are skbs, with the tick in
+ * the control buffer.
  */
+#define SNULL_WHEEL_SLOTS	1024
+#define SNULL_TICK_SHIFT	14	/* ~16us ticks, ~16ms a turn */
 
-struct snull_priv {
-	struct net_device_stats stats;
+struct snull_wheel {
+	spinlock_t lock;
+	struct hrtimer timer;
+	u64 cursor;			/* First tick not looked at yet */
+	u64 next_tick;			/* The timer is set for this one */
+	unsigned int count;		/* Packets on the wire */
+	unsigned long lost, reordered, overlimit;
+	struct net_device *dev;
+	int qid;
+	void *head[SNULL_WHEEL_SLOTS], *tail[SNULL_WHEEL_SLOTS];
+	DECLARE_BITMAP(busy, SNULL_WHEEL_SLOTS);
+};
+
+struct snull_emu {
+	u32 latency_us, jitter_us, rate_kbit, loss_ppm, reorder_ppm, limit;
+	int on;				/* Anything to emulate at all */
+	atomic64_t link_free;		/* When the last bit sent is out */
+};
+
+/*
+ * Each queue pair is like the queue of a multiqueue NIC, with its own
+ * "interrupt" (numbered after the queue), status word and NAPI
+ * context.  The traffic counters are per CPU, in snull_priv; the
+ * queue only keeps track of where its packets get lost, for ethtool.
+ */
+struct snull_queue {
+	spinlock_t lock;
 	int status;
-	struct snull_packet *ppool;
-	struct snull_packet *rx_queue;  /* List of incoming packets */
+	void **ring;                    /* Incoming packets, or skbs in zero-copy mode */
+	unsigned int head, tail;        /* Free-running ring indices */
+	int twin_stopped;               /* We stopped the twin's queue */
+	unsigned long ring_full;        /* Times the ring filled up */
+	unsigned long ring_drops;       /* Packets that found it full */
+	unsigned long rx_nomem;         /* Dropped for want of an skb */
 	int rx_int_enabled;
-	int tx_packetlen;
-	u8 *tx_packetdata;
-	struct sk_buff *skb;
-	spinlock_t lock;
+	struct sk_buff_head tx_done;    /* Sent, waiting for the TX interrupt */
+	unsigned long tx_count;         /* For the lockup simulation */
+	int tx_lockup;                  /* The TX interrupt got "lost" */
+	unsigned long tx_lockups;       /* Lost TX interrupts simulated */
+	unsigned long tx_timeouts;      /* ...and the watchdog catching them */
+	unsigned long tx_pool_empty;    /* Sends that ran a pool dry */
+	unsigned long tx_dropped;       /* Frames we could not send */
+#ifdef SNULL_XDP
+	struct xdp_rxq_info xdp_rxq;
+	int xdp_flush;                  /* Redirected, flush after the poll */
+	unsigned long xdp_drops;        /* What the XDP program did */
+	unsigned long xdp_tx;
+	unsigned long xdp_redirects;
+#endif
+#ifdef SNULL_XSK
+	struct xdp_umem *umem;          /* Bound AF_XDP socket, zero-copy */
+	atomic_t xsk_inflight;          /* Its frames out on the wire */
+	unsigned int xsk_seq, xsk_tail; /* Next to send, oldest not completed */
+	u8 xsk_fin[SNULL_XSK_MAX];      /* Back from the wire, by sequence */
+	unsigned long xsk_tx;
+#endif
+	struct snull_coal rx_coal, tx_coal;
+	struct snull_wheel *wheel;
 	struct net_device *dev;
 	struct napi_struct napi;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * This structure is private to each device. It is used to pass
+ * packets in and out, so there is place for a packet
+ */
+
+struct snull_priv {
+	struct pcpu_sw_netstats __percpu *tstats;
+	struct snull_pool __percpu *pools;
+	atomic_t dry_pools;		/* Pools that stopped the queues */
+	u32 rx_usecs, rx_frames;	/* Interrupt coalescing, see ethtool -C */
+	u32 tx_usecs, tx_frames;
+	struct snull_emu emu;
+	int port;			/* Our index in snull_devs */
+#ifdef SNULL_XDP
+	struct bpf_prog __rcu *xdp_prog;
+#endif
+	struct net_device *dev;
+	int nqueues;
+	struct snull_queue queues[];
 };
 
 static void snull_tx_timeout(struct net_device *dev);
+static void snull_fire(struct snull_coal *c);
 static void (*snull_interrupt)(int, void *, struct pt_regs *);
+#ifdef SNULL_XDP
+static u32 snull_run_xdp(struct net_device *dev, int qid,
+		struct snull_packet *pkt);
+#endif
+#ifdef SNULL_XSK
+static int snull_xsk_tx(struct snull_queue *q, int budget);
+#endif
 
 /*
- * Set up a device's packet pool.
+ * Set up a device's packet pools.
  */
 void snull_setup_pool(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	int i;
+	struct snull_pool *pool;
 	struct snull_packet *pkt;
+	int cpu, i;
 
-	priv->ppool = NULL;
-	for (i = 0; i < pool_size; i++) {
-		pkt = kmalloc (sizeof (struct snull_packet), GFP_KERNEL);
-		if (pkt == NULL) {
-			printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
-			return;
+	atomic_set(&priv->dry_pools, 0);
+	priv->pools = alloc_percpu(struct snull_pool);
+	if (priv->pools == NULL) {
+		printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
+		return;
+	}
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(priv->pools, cpu);
+		spin_lock_init(&pool->lock);
+		pool->dev = dev;
+		pool->ppool = NULL;
+		for (i = 0; i < pool_size; i++) {
+			pkt = kmalloc_node(sizeof (struct snull_packet) +
+					SNULL_HEADROOM + ETH_HLEN + max_mtu, GFP_KERNEL,
+					cpu_to_node(cpu));
+			if (pkt == NULL) {
+				printk (KERN_NOTICE "Ran out of memory allocating packet pool\n");
+				return;
+			}
+			pkt->pool = pool;
+			pkt->next = pool->ppool;
+			pool->ppool = pkt;
 		}
-		pkt->dev = dev;
-		pkt->next = priv->ppool;
-		priv->ppool = pkt;
 	}
 }
 
@@ -121,31 +362,80 @@ void snull_teardown_pool(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
 	struct snull_packet *pkt;
-    
-	while ((pkt = priv->ppool)) {
-		priv->ppool = pkt->next;
-		kfree (pkt);
-		/* FIXME - in-flight packets ? */
+	struct snull_pool *pool;
+	int cpu;
+
+	if (priv->pools == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(priv->pools, cpu);
+		while ((pkt = pool->ppool)) {
+			pool->ppool = pkt->next;
+			kfree (pkt);
+		}
 	}
+	free_percpu(priv->pools);
+	priv->pools = NULL;
 }    
 
 /*
- * Buffer/pool management.
+ * Traffic counters.  Each CPU has its own, 64 bits wide even on 32-bit
+ * hosts, where the syncp lets readers see both halves consistently.
+ * Interrupts go off around the update: the coalescing timers count
+ * from hard irq context, and could cut into the transmit path on
+ * the same CPU.
+ */
+static void snull_count(struct net_device *dev, int rx, unsigned int packets,
+		unsigned int bytes)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct pcpu_sw_netstats *stats;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	stats = this_cpu_ptr(priv->tstats);
+	u64_stats_update_begin(&stats->syncp);
+	if (rx) {
+		stats->rx_packets += packets;
+		stats->rx_bytes += bytes;
+	} else {
+		stats->tx_packets += packets;
+		stats->tx_bytes += bytes;
+	}
+	u64_stats_update_end(&stats->syncp);
+	local_irq_restore(flags);
+}
+
+/*
+ * Buffer/pool management.  When the pool of a CPU runs out, all the
+ * queues stop, since any of them may be sent from this CPU; they
+ * start again once every empty pool has got something back.
  */
-struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
+struct snull_packet *snull_get_tx_buffer(struct net_device *dev, int qid)
 {
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_pool *pool = this_cpu_ptr(priv->pools);
 	unsigned long flags;
 	struct snull_packet *pkt;
     
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->ppool;
-	priv->ppool = pkt->next;
-	if (priv->ppool == NULL) {
-		printk (KERN_INFO "Pool empty\n");
-		netif_stop_queue(dev);
-	}
-	spin_unlock_irqrestore(&priv->lock, flags);
+	spin_lock_irqsave(&pool->lock, flags);
+	pkt = pool->ppool;
+	if (pkt) {
+		pool->ppool = pkt->next;
+		pkt->data = pkt->buf + SNULL_HEADROOM;
+#ifdef SNULL_XSK
+		pkt->xsk = NULL;
+#endif
+	}
+	if (pool->ppool == NULL && !pool->dry) {
+		if (printk_ratelimit())
+			printk (KERN_INFO "Pool empty\n");
+		pool->dry = 1;
+		priv->queues[qid].tx_pool_empty++;
+		atomic_inc(&priv->dry_pools);
+		netif_tx_stop_all_queues(dev);
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
 	return pkt;
 }
 
@@ -153,48 +443,159 @@ struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
 void snull_release_buffer(struct snull_packet *pkt)
 {
 	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(pkt->dev);
+	struct snull_pool *pool = pkt->pool;
+	struct snull_priv *priv = netdev_priv(pool->dev);
+	int refilled;
 	
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->ppool;
-	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL)
-		netif_wake_queue(pkt->dev);
+#ifdef SNULL_XSK
+	if (pkt->xsk) {
+		/* The AF_XDP frame is done with: complete it from the poll */
+		struct snull_queue *xq = pkt->xsk;
+
+		smp_store_release(&xq->xsk_fin[pkt->xsk_seq &
+				(SNULL_XSK_MAX - 1)], 1);
+		smp_mb__before_atomic();
+		atomic_dec(&xq->xsk_inflight);
+		napi_schedule(&xq->napi);
+	}
+#endif
+	spin_lock_irqsave(&pool->lock, flags);
+	pkt->next = pool->ppool;
+	pool->ppool = pkt;
+	refilled = pool->dry;
+	pool->dry = 0;
+	spin_unlock_irqrestore(&pool->lock, flags);
+	if (refilled && atomic_dec_and_test(&priv->dry_pools))
+		netif_tx_wake_all_queues(pool->dev);
 }
 
-void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt)
+/*
+ * The receive rings.  Each is fed by the queues with the same number
+ * on the other interfaces.  A twin's queue is stopped when the ring
+ * fills up and started again once it is half empty; behind a switch
+ * there is no such back pressure, and what finds the ring full is lost.
+ */
+static struct net_device *snull_twin(struct net_device *dev)
 {
-	unsigned long flags;
 	struct snull_priv *priv = netdev_priv(dev);
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;  /* FIXME - misorders packets */
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	return snull_devs[!priv->port];
 }
 
-struct snull_packet *snull_dequeue_buf(struct net_device *dev)
+static void snull_setup_rings(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
+	struct snull_queue *q;
+	int i;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		q = priv->queues + i;
+		q->ring = kcalloc(ring_size, sizeof(void *), GFP_KERNEL);
+		if (q->ring == NULL) {
+			printk (KERN_NOTICE "Ran out of memory allocating rings\n");
+			return;
+		}
+#ifdef SNULL_XDP
+		/* Redirected frames are copied to pages of their own */
+		if (xdp_rxq_info_reg(&q->xdp_rxq, dev, i) < 0 ||
+		    xdp_rxq_info_reg_mem_model(&q->xdp_rxq,
+				MEM_TYPE_PAGE_ORDER0, NULL) < 0) {
+			printk (KERN_NOTICE "snull: can't register XDP queue %d\n", i);
+			if (xdp_rxq_info_is_reg(&q->xdp_rxq))
+				xdp_rxq_info_unreg(&q->xdp_rxq);
+			kfree(q->ring);
+			q->ring = NULL;
+			return;
+		}
+#endif
+	}
+}
+
+static void snull_teardown_rings(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	void *entry;
+	int i;
+
+	/* The device is down: give back what is still queued */
+	for (i = 0; i < priv->nqueues; i++) {
+		q = priv->queues + i;
+		skb_queue_purge(&q->tx_done);
+		if (q->ring == NULL)
+			continue;
+#ifdef SNULL_XDP
+		xdp_rxq_info_unreg(&q->xdp_rxq);
+#endif
+		for (; q->tail != q->head; q->tail++) {
+			entry = q->ring[q->tail & (ring_size - 1)];
+			if (zerocopy)
+				kfree_skb(entry);
+			else
+				snull_release_buffer(entry);
+		}
+		kfree(q->ring);
+		q->ring = NULL;
+	}
+}
+
+static int snull_enqueue(struct net_device *dev, int qid, void *entry)
+{
+	unsigned long flags;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = priv->queues + qid;
+	int ret = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (q->head - q->tail == ring_size) {
+		q->ring_drops++;
+		atomic_long_inc(&dev->rx_dropped);
+		ret = -ENOBUFS;
+		goto out;
+	}
+	q->ring[q->head++ & (ring_size - 1)] = entry;
+	if (q->head - q->tail == ring_size) {
+		q->ring_full++;
+		if (nr_devs == 2) {
+			q->twin_stopped = 1;
+			netif_tx_stop_queue(netdev_get_tx_queue(snull_twin(dev), qid));
+		}
+	}
+  out:
+	spin_unlock_irqrestore(&q->lock, flags);
+	return ret;
+}
+
+static void *snull_dequeue(struct net_device *dev, int qid)
+{
 	unsigned long flags;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = priv->queues + qid;
+	void *entry = NULL;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (q->head != q->tail)
+		entry = q->ring[q->tail++ & (ring_size - 1)];
+	if (q->twin_stopped && q->head - q->tail <= ring_size / 2) {
+		q->twin_stopped = 0;
+		netif_tx_wake_queue(netdev_get_tx_queue(snull_twin(dev), qid));
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	return entry;
+}
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL)
-		priv->rx_queue = pkt->next;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+static int snull_rx_pending(struct snull_queue *q)
+{
+	return READ_ONCE(q->head) != q->tail;
 }
 
 /*
  * Enable and disable receive interrupts.
  */
-static void snull_rx_ints(struct net_device *dev, int enable)
+static void snull_rx_ints(struct net_device *dev, int qid, int enable)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	priv->rx_int_enabled = enable;
+	priv->queues[qid].rx_int_enabled = enable;
 }
 
     
@@ -204,25 +605,52 @@ static void snull_rx_ints(struct net_device *dev, int enable)
 
 int snull_open(struct net_device *dev)
 {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
 	/* request_region(), request_irq(), ....  (like fops->open) */
+	for (i = 0; i < priv->nqueues; i++)
+		if (priv->queues[i].ring == NULL)
+			return -ENOMEM;	/* snull_setup_rings failed */
+	if (priv->tstats == NULL)
+		return -ENOMEM;
 
 	/* 
 	 * Assign the hardware address of the board: use "\0SNULx", where
-	 * x is 0 or 1. The first byte is '\0' to avoid being a multicast
-	 * address (the first byte of multicast addrs is odd).
+	 * x is 0 or 1, and so on for more ports (carrying into the 'L').
+	 * The first byte is '\0' to avoid being a multicast address (the
+	 * first byte of multicast addrs is odd).
 	 */
 	memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
-	if (dev == snull_devs[1])
-		dev->dev_addr[ETH_ALEN-1]++; /* \0SNUL1 */
-	netif_start_queue(dev);
+	i = ((dev->dev_addr[ETH_ALEN-2] << 8) | dev->dev_addr[ETH_ALEN-1]) +
+			priv->port;
+	dev->dev_addr[ETH_ALEN-2] = i >> 8;
+	dev->dev_addr[ETH_ALEN-1] = i; /* \0SNUL1 for sn1 */
+	if (use_napi)
+		for (i = 0; i < priv->nqueues; i++)
+			napi_enable(&priv->queues[i].napi);
+	netif_tx_start_all_queues(dev);
 	return 0;
 }
 
 int snull_release(struct net_device *dev)
 {
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
     /* release ports, irq and such -- like fops->close */
 
-	netif_stop_queue(dev); /* can't transmit any more */
+	netif_tx_stop_all_queues(dev); /* can't transmit any more */
+	if (use_napi)
+		for (i = 0; i < priv->nqueues; i++)
+			napi_disable(&priv->queues[i].napi);
+	/* Held-back interrupts: RX can wait for the next open, TX can't */
+	for (i = 0; i < priv->nqueues; i++) {
+		hrtimer_cancel(&priv->queues[i].rx_coal.timer);
+		hrtimer_cancel(&priv->queues[i].tx_coal.timer);
+		priv->queues[i].tx_lockup = 0;
+		snull_fire(&priv->queues[i].tx_coal);
+	}
 	return 0;
 }
 
@@ -251,13 +679,37 @@ int snull_config(struct net_device *dev, struct ifmap *map)
 }
 
 /*
- * Receive a packet: retrieve, encapsulate and pass over to upper levels
+ * Receive a packet: retrieve, encapsulate and get it ready for the
+ * upper levels.  In zero-copy mode there is nothing to encapsulate:
+ * the sender's skb only needs its metadata.  Returns NULL if the queue
+ * was empty, the packet had to be dropped or XDP took it.
  */
-void snull_rx(struct net_device *dev, struct snull_packet *pkt)
+static struct sk_buff *snull_rx(struct net_device *dev, int qid)
 {
 	struct sk_buff *skb;
 	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = priv->queues + qid;
+	struct snull_packet *pkt;
+
+	if (zerocopy) {
+		skb = snull_dequeue(dev, qid);
+		if (!skb)
+			return NULL;
+		/* the checksum was never filled in if still partial */
+		if (skb->ip_summed != CHECKSUM_PARTIAL)
+			skb->ip_summed = CHECKSUM_UNNECESSARY;
+		goto meta;
+	}
 
+	pkt = snull_dequeue(dev, qid);
+	if (!pkt)
+		return NULL;
+#ifdef SNULL_XDP
+	/* The XDP program sees the frame before there is any skb */
+	if (rcu_access_pointer(priv->xdp_prog) &&
+	    snull_run_xdp(dev, qid, pkt) != XDP_PASS)
+		return NULL;
+#endif
 	/*
 	 * The packet has been retrieved from the transmission
 	 * medium. Build an skb around it, so upper layers can handle it
@@ -266,24 +718,96 @@ void snull_rx(struct net_device *dev, struct snull_packet *pkt)
 	if (!skb) {
 		if (printk_ratelimit())
 			printk(KERN_NOTICE "snull rx: low on mem - packet dropped\n");
-		priv->stats.rx_dropped++;
-		goto out;
+		q->rx_nomem++;
+		atomic_long_inc(&dev->rx_dropped);
+		snull_release_buffer(pkt);
+		return NULL;
 	}
 	skb_reserve(skb, 2); /* align IP on 16B boundary */  
 	memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
+	snull_release_buffer(pkt);
+	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
 
 	/* Write metadata, and then pass to the receive level */
+  meta:
+	snull_count(dev, 1, 1, skb->len);
 	skb->dev = dev;
 	skb->protocol = eth_type_trans(skb, dev);
-	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
-	netif_rx(skb);//hand off the socket buffer to the upper layers.
-  out:
-	return;
+	skb_record_rx_queue(skb, qid);
+	return skb;
 }
     
 
+/*
+ * Under the queue lock: account for the finished transmissions and
+ * take them off the queue, to be freed once the lock is dropped.
+ */
+static void snull_tx_done(struct snull_queue *q, struct sk_buff_head *done)
+{
+	struct sk_buff *skb;
+	unsigned int bytes = 0;
+
+	if (skb_queue_empty(&q->tx_done))
+		return;
+	skb_queue_walk(&q->tx_done, skb)
+		bytes += skb->len;
+	snull_count(q->dev, 0, skb_queue_len(&q->tx_done), bytes);
+	skb_queue_splice_tail_init(&q->tx_done, done);
+}
+
+/*
+ * Interrupt coalescing.  snull_coalesce counts an event and either
+ * fires the interrupt or makes sure the timer will; snull_fire raises
+ * it, unless RX interrupts are masked because NAPI is polling anyway.
+ */
+static void snull_fire(struct snull_coal *c)
+{
+	struct snull_queue *q = c->q;
+	struct snull_priv *priv = netdev_priv(q->dev);
+	unsigned long flags;
+	int fire;
+
+	spin_lock_irqsave(&q->lock, flags);
+	c->events = 0;
+	hrtimer_try_to_cancel(&c->timer);	/* fails harmlessly from the timer */
+	fire = c->intr == SNULL_TX_INTR || q->rx_int_enabled;
+	if (fire)
+		q->status |= c->intr;
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (fire)
+		snull_interrupt(q - priv->queues, q->dev, NULL);
+}
+
+static void snull_coalesce(struct snull_coal *c, u32 usecs, u32 frames)
+{
+	unsigned long flags;
+	int fire = 0;
+
+	spin_lock_irqsave(&c->q->lock, flags);
+	if (++c->events >= frames || !usecs)
+		fire = 1;
+	else if (!hrtimer_active(&c->timer))
+		hrtimer_start(&c->timer, ns_to_ktime((u64) usecs * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&c->q->lock, flags);
+	if (fire)
+		snull_fire(c);
+}
+
+static enum hrtimer_restart snull_coal_timer(struct hrtimer *timer)
+{
+	snull_fire(container_of(timer, struct snull_coal, timer));
+	return HRTIMER_NORESTART;
+}
+
+static void snull_setup_coal(struct snull_queue *q, struct snull_coal *c, int intr)
+{
+	hrtimer_init(&c->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	c->timer.function = snull_coal_timer;
+	c->intr = intr;
+	c->q = q;
+}
+
 /*
  * The poll implementation.
  * @param buget the maximum number of packets that 
@@ -293,52 +817,67 @@ static int snull_poll(struct napi_struct *napi, int budget)
 {
 	int npackets = 0;
 	struct sk_buff *skb;
-	struct snull_priv *priv = container_of(napi, struct snull_priv, napi);
-	struct net_device *dev = priv->dev;
-	struct snull_packet *pkt;
+	struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct net_device *dev = q->dev;
+	int qid = q - priv->queues;
+	int gro = dev->features & NETIF_F_GRO;
+	int more = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	LIST_HEAD(rx_list);
+#endif
     
-	while (npackets < budget && priv->rx_queue) {
-		pkt = snull_dequeue_buf(dev);
-		skb = dev_alloc_skb(pkt->datalen + 2);
-		if (! skb) {
-			if (printk_ratelimit())
-				printk(KERN_NOTICE "snull: packet dropped\n");
-			priv->stats.rx_dropped++;
-			snull_release_buffer(pkt);
-			continue;
-		}
-		skb_reserve(skb, 2); /* align IP on 16B boundary */  
-		memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
-		skb->dev = dev;
-		skb->protocol = eth_type_trans(skb, dev);
-		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-		netif_receive_skb(skb); //feed packets to the kernel
-		
-        	/* Maintain stats */
+#ifdef SNULL_XSK
+	/* An AF_XDP socket's transmissions are polled like receptions */
+	if (q->umem)
+		more = snull_xsk_tx(q, budget);
+#endif
+	while (npackets < budget && snull_rx_pending(q)) {
+		skb = snull_rx(dev, qid);
 		npackets++;
-		priv->stats.rx_packets++;
-		priv->stats.rx_bytes += pkt->datalen;
-		snull_release_buffer(pkt);
+		if (!skb)
+			continue;	/* dropped, or taken by XDP */
+		if (gro)
+			napi_gro_receive(napi, skb); //feed packets to the kernel, merging flows
+		else
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+			list_add_tail(&skb->list, &rx_list); /* all at once, below */
+#else
+			netif_receive_skb(skb); //feed packets to the kernel
+#endif
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	netif_receive_skb_list(&rx_list);
+#endif
+#ifdef SNULL_XDP
+	if (q->xdp_flush) {
+		q->xdp_flush = 0;
+		xdp_do_flush_map();
 	}
+#endif
 	/* If we processed all packets, we're done; tell the kernel and reenable ints */
-	if (! priv->rx_queue) {
+	if (! snull_rx_pending(q) && !more) {
 		napi_complete(napi); //obsolete: netif_rx_complete(dev);
-		snull_rx_ints(dev, 1);
+		snull_rx_ints(dev, qid, 1);
 		return 0;
 	}
-	/* We couldn't process everything. */
-	return npackets;
+	/* We couldn't process everything: poll again */
+	return budget;
 }
 	    
         
 /*
- * The typical interrupt entry point
+ * The typical interrupt entry point.  Each queue has its own
+ * interrupt, and "irq" is the number of the queue.
  */
 static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	int statusword;
 	struct snull_priv *priv;
-	struct snull_packet *pkt = NULL;
+	struct snull_queue *q;
+	struct sk_buff *skb, *rx_skb;
+	struct sk_buff_head done;
+	unsigned long flags;
 	/*
 	 * As usual, check the "device" pointer to be sure it is
 	 * really interrupting.
@@ -351,31 +890,34 @@ static void snull_regular_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	if (!dev)
 		return;
 
-	/* Lock the device */
+	/* Lock the queue; the coalescing timers call in from hard irq */
 	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+	q = priv->queues + irq;
+	__skb_queue_head_init(&done);
+	spin_lock_irqsave(&q->lock, flags);
 
 	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
+	statusword = q->status;
+	q->status = 0;
+	if (statusword & SNULL_TX_INTR)
+		snull_tx_done(q, &done);
+
+	/* Unlock the queue and we are done */
+	spin_unlock_irqrestore(&q->lock, flags);
 	if (statusword & SNULL_RX_INTR) {
-		/* send it to snull_rx for handling */
-		pkt = priv->rx_queue;
-		if (pkt) {
-			priv->rx_queue = pkt->next;
-			snull_rx(dev, pkt);
+		/*
+		 * One interrupt may stand for several packets: empty the
+		 * ring.  snull_rx takes the queue lock itself.
+		 */
+		while (snull_rx_pending(q)) {
+			rx_skb = snull_rx(dev, irq);
+			if (rx_skb)
+				netif_rx(rx_skb);//hand off the socket buffer to the upper layers.
 		}
 	}
-	if (statusword & SNULL_TX_INTR) {
-		/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
-	}
-
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
-	if (pkt) snull_release_buffer(pkt); /* Do this outside the lock! */
+	/* a transmission is over: free the skbs */
+	while ((skb = __skb_dequeue(&done)))
+		dev_kfree_skb_any(skb);
 	return;
 }
 
@@ -386,6 +928,10 @@ static void snull_napi_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	int statusword;
 	struct snull_priv *priv;
+	struct snull_queue *q;
+	struct sk_buff *skb;
+	struct sk_buff_head done;
+	unsigned long flags;
 
 	/*
 	 * As usual, check the "device" pointer for shared handlers.
@@ -398,67 +944,40 @@ static void snull_napi_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	if (!dev)
 		return;
 
-	/* Lock the device */
+	/* Lock the queue; the coalescing timers call in from hard irq */
 	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+	q = priv->queues + irq;
+	__skb_queue_head_init(&done);
+	spin_lock_irqsave(&q->lock, flags);
 
 	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
+	statusword = q->status;
+	q->status = 0;
 	if (statusword & SNULL_RX_INTR) {
-		snull_rx_ints(dev, 0);  /* Disable further interrupts */
-		napi_schedule(&priv->napi);//obsolete: netif_rx_schedule(dev);
-	}
-	if (statusword & SNULL_TX_INTR) {
-        	/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
+		snull_rx_ints(dev, irq, 0);  /* Disable further interrupts */
+		napi_schedule(&q->napi);//obsolete: netif_rx_schedule(dev);
 	}
-
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
+	if (statusword & SNULL_TX_INTR)
+		snull_tx_done(q, &done);
+
+	/* Unlock the queue and we are done */
+	spin_unlock_irqrestore(&q->lock, flags);
+        /* a transmission is over: free the skbs */
+	while ((skb = __skb_dequeue(&done)))
+		dev_kfree_skb_any(skb);
 	return;
 }
 
 
 
 /*
- * Transmit a packet (low level interface)
+ * The snull "wire": swap the networks of the addresses, so that the
+ * packet looks like it comes from the other side.
  */
-static void snull_hw_tx(char *buf, int len, struct net_device *dev)
+static void snull_rewrite_ip(struct net_device *dev, struct iphdr *ih)
 {
-	/*
-	 * This function deals with hw details. This interface loops
-	 * back the packet to the other snull interface (if any).
-	 * In other words, this function implements the snull behaviour,
-	 * while all other procedures are rather device-independent
-	 */
-	struct iphdr *ih;
-	struct net_device *dest;
-	struct snull_priv *priv;
 	u32 *saddr, *daddr;
-	struct snull_packet *tx_buffer;
-    
-	/* I am paranoid. Ain't I? */
-	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
-		printk("snull: Hmm... packet too short (%i octets)\n",
-				len);
-		return;
-	}
 
-	if (0) { /* enable this conditional to look at the data */
-		int i;
-		PDEBUG("len is %i\n" KERN_DEBUG "data:",len);
-		for (i=14 ; i<len; i++)
-			printk(" %02x",buf[i]&0xff);
-		printk("\n");
-	}
-	/*
-	 * Ethhdr is 14 bytes, but the kernel arranges for iphdr
-	 * to be aligned (i.e., ethhdr is unaligned)
-	 */
-	ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
 	saddr = &ih->saddr;
 	daddr = &ih->daddr;
 
@@ -476,82 +995,1005 @@ static void snull_hw_tx(char *buf, int len, struct net_device *dev)
 		PDEBUGG("%08x:%05i <-- %08x:%05i\n",
 				ntohl(ih->daddr),ntohs(((struct tcphdr *)(ih+1))->dest),
 				ntohl(ih->saddr),ntohs(((struct tcphdr *)(ih+1))->source));
-
-	/*
-	 * Ok, now the packet is ready for transmission: first simulate a
-	 * receive interrupt on the twin device, then  a
-	 * transmission-done on the transmitting device
-	 */
-	dest = snull_devs[dev == snull_devs[0] ? 1 : 0];
-	priv = netdev_priv(dest);
-	tx_buffer = snull_get_tx_buffer(dev);
-	tx_buffer->datalen = len;
-	memcpy(tx_buffer->data, buf, len);
-	snull_enqueue_buf(dest, tx_buffer);
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;
-		snull_interrupt(0, dest, NULL);
-	}
-
-	priv = netdev_priv(dev);
-	priv->tx_packetlen = len;
-	priv->tx_packetdata = buf;
-	priv->status |= SNULL_TX_INTR;
-	if (lockup && ((priv->stats.tx_packets + 1) % lockup) == 0) {
-        	/* Simulate a dropped transmit interrupt */
-		netif_stop_queue(dev);
-		PDEBUG("Simulate lockup at %ld, txp %ld\n", jiffies,
-				(unsigned long) priv->stats.tx_packets);
-	}
-	else
-		snull_interrupt(0, dev, NULL);
 }
 
 /*
- * Transmit a packet (called by the kernel)
+ * Simulate a receive interrupt on a queue, unless it's masked or
+ * held back by coalescing.
  */
-int snull_tx(struct sk_buff *skb, struct net_device *dev)
+static void snull_raise_rx(struct net_device *dev, int qid)
 {
-	int len;
-	char *data, shortpkt[ETH_ZLEN];
 	struct snull_priv *priv = netdev_priv(dev);
-	
-	data = skb->data;
-	len = skb->len;
-	if (len < ETH_ZLEN) {
-		memset(shortpkt, 0, ETH_ZLEN);
-		memcpy(shortpkt, skb->data, skb->len);
-		len = ETH_ZLEN;
-		data = shortpkt;
-	}
-	trans_start = jiffies; /* save the timestamp */
-
-	/* Remember the skb, so we can free it at interrupt time */
-	priv->skb = skb;
-
-	/* actual deliver of data is device-specific, and not shown here */
-	snull_hw_tx(data, len, dev);
 
-	return 0; /* Our simple device can not fail */
+	snull_coalesce(&priv->queues[qid].rx_coal, priv->rx_usecs,
+			priv->rx_frames);
 }
 
 /*
- * Deal with a transmit timeout.
+ * The link emulation.  snull_emulate takes the packets from the
+ * transmitters: with nothing to emulate they go straight to the twin,
+ * lost ones are freed, and the others wait in the wheel of the queue.
  */
-void snull_tx_timeout (struct net_device *dev)
+struct snull_skb_cb {
+	u64 tick;
+};
+#define SNULL_SKB_CB(skb) ((struct snull_skb_cb *)(skb)->cb)
+
+static void **snull_wire_next(void *entry)
 {
-	struct snull_priv *priv = netdev_priv(dev);
+	if (zerocopy)
+		return (void **)&((struct sk_buff *)entry)->next;
+	return (void **)&((struct snull_packet *)entry)->next;
+}
+
+static u64 *snull_wire_tick(void *entry)
+{
+	if (zerocopy)
+		return &SNULL_SKB_CB((struct sk_buff *)entry)->tick;
+	return &((struct snull_packet *)entry)->tick;
+}
+
+static void snull_wire_free(void *entry)
+{
+	if (zerocopy)
+		dev_kfree_skb_any(entry);
+	else
+		snull_release_buffer(entry);
+}
+
+static void snull_deliver_to(struct net_device *dev, struct net_device *dest,
+		int qid, void *entry)
+{
+	if (zerocopy)	/* cut the ties with the sending side */
+		skb_scrub_packet(entry, !net_eq(dev_net(dev), dev_net(dest)));
+	if (snull_enqueue(dest, qid, entry))
+		snull_wire_free(entry);
+	else
+		snull_raise_rx(dest, qid);
+}
+
+/*
+ * The switch.  It learns where each source address lives, in a hash
+ * table that the forwarding path only reads under RCU, and floods what
+ * it doesn't know, like broadcasts, to all the other ports.  Entries
+ * not heard from in a while are aged out.
+ */
+#define SNULL_FDB_BITS		8
+#define SNULL_FDB_MAX		4096		/* Entries, to bound a flood */
+#define SNULL_FDB_AGE		(300 * HZ)
+
+struct snull_fdb {
+	struct hlist_node hlist;
+	struct rcu_head rcu;
+	u8 addr[ETH_ALEN];
+	int port;
+	unsigned long updated;
+};
+
+static DEFINE_HASHTABLE(snull_fdb, SNULL_FDB_BITS);
+static DEFINE_SPINLOCK(snull_fdb_lock);	/* Writers only */
+static int snull_fdb_count;
+static struct delayed_work snull_fdb_work;
+
+static struct snull_fdb *snull_fdb_find(const u8 *addr)
+{
+	struct snull_fdb *f;
+
+	hash_for_each_possible_rcu(snull_fdb, f, hlist, jhash(addr, ETH_ALEN, 0))
+		if (ether_addr_equal(f->addr, addr))
+			return f;
+	return NULL;
+}
+
+static void snull_fdb_learn(const u8 *addr, int port)
+{
+	struct snull_fdb *f;
+	unsigned long flags;
+
+	if (!is_valid_ether_addr(addr))
+		return;
+	rcu_read_lock();
+	f = snull_fdb_find(addr);
+	if (f) {
+		/* Every port reads the entry: write it only on a change */
+		if (READ_ONCE(f->port) != port)
+			WRITE_ONCE(f->port, port);
+		if (READ_ONCE(f->updated) != jiffies)
+			WRITE_ONCE(f->updated, jiffies);
+	}
+	rcu_read_unlock();
+	if (f)
+		return;
+
+	spin_lock_irqsave(&snull_fdb_lock, flags);
+	if (!snull_fdb_find(addr) && snull_fdb_count < SNULL_FDB_MAX) {
+		f = kmalloc(sizeof(*f), GFP_ATOMIC);
+		if (f) {
+			ether_addr_copy(f->addr, addr);
+			f->port = port;
+			f->updated = jiffies;
+			hash_add_rcu(snull_fdb, &f->hlist, jhash(addr, ETH_ALEN, 0));
+			snull_fdb_count++;
+		}
+	}
+	spin_unlock_irqrestore(&snull_fdb_lock, flags);
+}
+
+static int snull_fdb_lookup(const u8 *addr)
+{
+	struct snull_fdb *f;
+	int port = -1;
+
+	rcu_read_lock();
+	f = snull_fdb_find(addr);
+	if (f)
+		port = READ_ONCE(f->port);
+	rcu_read_unlock();
+	return port;
+}
+
+/* Age out old entries, or all of them */
+static void snull_fdb_flush(int all)
+{
+	struct snull_fdb *f;
+	struct hlist_node *tmp;
+	unsigned long flags;
+	int bkt;
+
+	spin_lock_irqsave(&snull_fdb_lock, flags);
+	hash_for_each_safe(snull_fdb, bkt, tmp, f, hlist)
+		if (all || time_after(jiffies, f->updated + SNULL_FDB_AGE)) {
+			hash_del_rcu(&f->hlist);
+			kfree_rcu(f, rcu);
+			snull_fdb_count--;
+		}
+	spin_unlock_irqrestore(&snull_fdb_lock, flags);
+}
+
+static void snull_fdb_age(struct work_struct *work)
+{
+	snull_fdb_flush(0);
+	schedule_delayed_work(&snull_fdb_work, SNULL_FDB_AGE / 10);
+}
+
+static void *snull_wire_copy(struct net_device *dev, int qid, void *entry)
+{
+	struct snull_packet *pkt = entry, *copy;
+
+	if (zerocopy)
+		return skb_clone(entry, GFP_ATOMIC);
+	copy = snull_get_tx_buffer(dev, qid);
+	if (copy) {
+		memcpy(copy->data, pkt->data, pkt->datalen);
+		copy->datalen = pkt->datalen;
+	}
+	return copy;
+}
+
+/*
+ * A packet comes off the link: hand it to the twin, or switch it.
+ */
+static void snull_deliver(struct net_device *dev, int qid, void *entry)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct ethhdr *eth;
+	void *copy;
+	int port, i, last;
+
+	if (nr_devs == 2) {
+		snull_deliver_to(dev, snull_twin(dev), qid, entry);
+		return;
+	}
+	eth = zerocopy ? (struct ethhdr *)((struct sk_buff *)entry)->data :
+			(struct ethhdr *)((struct snull_packet *)entry)->data;
+	snull_fdb_learn(eth->h_source, priv->port);
+	port = is_unicast_ether_addr(eth->h_dest) ?
+			snull_fdb_lookup(eth->h_dest) : -1;
+	if (port == priv->port) {	/* it's on our side already */
+		snull_wire_free(entry);
+		return;
+	}
+	if (port >= 0) {
+		snull_deliver_to(dev, snull_devs[port], qid, entry);
+		return;
+	}
+	/* Flood: a copy for each port, and the packet itself for the last */
+	last = nr_devs - 1;
+	if (last == priv->port)
+		last--;
+	for (i = 0; i < last; i++) {
+		if (i == priv->port)
+			continue;
+		copy = snull_wire_copy(dev, qid, entry);
+		if (copy)
+			snull_deliver_to(dev, snull_devs[i], qid, copy);
+	}
+	snull_deliver_to(dev, snull_devs[last], qid, entry);
+}
+
+/*
+ * Under the wheel lock: set the timer for the first busy slot from
+ * "tick" on, or leave it off if the wheel is empty.
+ */
+static void snull_wheel_arm(struct snull_wheel *w, u64 tick)
+{
+	unsigned int slot = tick & (SNULL_WHEEL_SLOTS - 1);
+	unsigned int next;
+
+	if (!w->count) {
+		w->next_tick = U64_MAX;
+		return;
+	}
+	next = find_next_bit(w->busy, SNULL_WHEEL_SLOTS, slot);
+	if (next == SNULL_WHEEL_SLOTS)
+		next = find_first_bit(w->busy, SNULL_WHEEL_SLOTS) +
+				SNULL_WHEEL_SLOTS;
+	w->next_tick = tick + next - slot;
+	hrtimer_start(&w->timer, ns_to_ktime(w->next_tick << SNULL_TICK_SHIFT),
+			HRTIMER_MODE_ABS);
+}
+
+static enum hrtimer_restart snull_wheel_timer(struct hrtimer *timer)
+{
+	struct snull_wheel *w = container_of(timer, struct snull_wheel, timer);
+	void *entry, **link, *due = NULL, **due_tail = &due;
+	u64 now = ktime_get_ns() >> SNULL_TICK_SHIFT, t;
+	unsigned long flags;
+	unsigned int slot;
+
+	spin_lock_irqsave(&w->lock, flags);
+	/* After a long nap, one turn of the wheel sees everything */
+	t = w->cursor;
+	if (now - t >= SNULL_WHEEL_SLOTS)
+		t = now - SNULL_WHEEL_SLOTS + 1;
+	for (; t <= now && w->count; t++) {
+		slot = t & (SNULL_WHEEL_SLOTS - 1);
+		if (!test_bit(slot, w->busy))
+			continue;
+		/* Unlink what is due, keep the later turns in order */
+		w->tail[slot] = NULL;
+		for (link = &w->head[slot]; (entry = *link); ) {
+			if (*snull_wire_tick(entry) > now) {
+				w->tail[slot] = entry;
+				link = snull_wire_next(entry);
+				continue;
+			}
+			*link = *snull_wire_next(entry);
+			*due_tail = entry;
+			due_tail = snull_wire_next(entry);
+			w->count--;
+		}
+		if (!w->head[slot])
+			clear_bit(slot, w->busy);
+	}
+	*due_tail = NULL;
+	w->cursor = now + 1;
+	snull_wheel_arm(w, w->cursor);
+	spin_unlock_irqrestore(&w->lock, flags);
+
+	while ((entry = due)) {
+		due = *snull_wire_next(entry);
+		snull_deliver(w->dev, w->qid, entry);
+	}
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Shape to the link rate: the packet leaves once the link is done
+ * with whatever was sent before it, on any queue.
+ */
+static u64 snull_shape(struct snull_emu *emu, u64 now, unsigned int len,
+		u32 rate_kbit)
+{
+	u64 txtime = div_u64((u64) len * 8 * USEC_PER_SEC, rate_kbit);
+	s64 old, start;
+
+	do {
+		old = atomic64_read(&emu->link_free);
+		start = max_t(s64, old, now);
+	} while (atomic64_cmpxchg(&emu->link_free, old, start + txtime) != old);
+	return start + txtime;
+}
+
+static void snull_emulate(struct net_device *dev, int qid, void *entry,
+		unsigned int len)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_emu *emu = &priv->emu;
+	struct snull_wheel *w = priv->queues[qid].wheel;
+	u32 loss, reorder, rate, jitter;
+	unsigned long flags;
+	u64 now, due, tick;
+	unsigned int slot;
+
+	if (!READ_ONCE(emu->on) || !w)
+		goto deliver;
+	loss = READ_ONCE(emu->loss_ppm);
+	if (loss && prandom_u32_max(1000000) < loss) {
+		w->lost++;
+		snull_wire_free(entry);
+		return;
+	}
+	if (READ_ONCE(w->count) >= READ_ONCE(emu->limit)) {
+		w->overlimit++;
+		snull_wire_free(entry);
+		return;
+	}
+
+	now = due = ktime_get_ns();
+	rate = READ_ONCE(emu->rate_kbit);
+	if (rate)
+		due = snull_shape(emu, now, len, rate);
+	reorder = READ_ONCE(emu->reorder_ppm);
+	if (reorder && prandom_u32_max(1000000) < reorder) {
+		w->reordered++;		/* no delay: overtake the others */
+	} else {
+		due += (u64) READ_ONCE(emu->latency_us) * NSEC_PER_USEC;
+		/* up to a second, or the sums below overflow */
+		jitter = min(READ_ONCE(emu->jitter_us), 1000000U) * NSEC_PER_USEC;
+		if (jitter)
+			due = max_t(s64, now, due +
+					prandom_u32_max(2 * jitter + 1) - jitter);
+	}
+	if (due <= now)
+		goto deliver;
+
+	/* Due in a tick not looked at yet, and never early */
+	tick = (due + (1 << SNULL_TICK_SHIFT) - 1) >> SNULL_TICK_SHIFT;
+	spin_lock_irqsave(&w->lock, flags);
+	tick = max(tick, w->cursor);
+	slot = tick & (SNULL_WHEEL_SLOTS - 1);
+	*snull_wire_tick(entry) = tick;
+	*snull_wire_next(entry) = NULL;
+	if (w->tail[slot])
+		*snull_wire_next(w->tail[slot]) = entry;
+	else
+		w->head[slot] = entry;
+	w->tail[slot] = entry;
+	set_bit(slot, w->busy);
+	w->count++;
+	if (tick < w->next_tick)
+		snull_wheel_arm(w, tick);
+	spin_unlock_irqrestore(&w->lock, flags);
+	return;
+
+  deliver:
+	snull_deliver(dev, qid, entry);
+}
+
+/*
+ * The wheels are not worth having without anything to emulate, but a
+ * queue does not know whether there will be: they come with the rings.
+ */
+static void snull_setup_wheels(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_wheel *w;
+	int i;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		w = kzalloc(sizeof(*w), GFP_KERNEL);
+		if (w == NULL) {
+			printk (KERN_NOTICE "snull: no link emulation on queue %d\n", i);
+			continue;
+		}
+		spin_lock_init(&w->lock);
+		hrtimer_init(&w->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		w->timer.function = snull_wheel_timer;
+		w->cursor = ktime_get_ns() >> SNULL_TICK_SHIFT;
+		w->next_tick = U64_MAX;
+		w->dev = dev;
+		w->qid = i;
+		priv->queues[i].wheel = w;
+	}
+}
+
+/*
+ * Both interfaces must be stopped before either's rings go: a wheel
+ * delivers to the other side.
+ */
+static void snull_teardown_wheels(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_wheel *w;
+	void *entry;
+	int i, slot;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		w = priv->queues[i].wheel;
+		if (w == NULL)
+			continue;
+		hrtimer_cancel(&w->timer);
+		for (slot = 0; slot < SNULL_WHEEL_SLOTS; slot++)
+			while ((entry = w->head[slot])) {
+				w->head[slot] = *snull_wire_next(entry);
+				snull_wire_free(entry);
+			}
+		kfree(w);
+		priv->queues[i].wheel = NULL;
+	}
+}
+
+/*
+ * The emulation settings of each interface, in sysfs.
+ */
+static void snull_emu_update(struct snull_emu *emu)
+{
+	WRITE_ONCE(emu->on, emu->latency_us || emu->jitter_us ||
+			emu->rate_kbit || emu->loss_ppm || emu->reorder_ppm);
+}
+
+#define SNULL_EMU_ATTR(field)						\
+static ssize_t field##_show(struct device *d,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));		\
+									\
+	return sprintf(buf, "%u\n", priv->emu.field);			\
+}									\
+static ssize_t field##_store(struct device *d,				\
+		struct device_attribute *attr, const char *buf,		\
+		size_t count)						\
+{									\
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));		\
+	u32 val;							\
+	int err = kstrtou32(buf, 0, &val);				\
+									\
+	if (err)							\
+		return err;						\
+	WRITE_ONCE(priv->emu.field, val);				\
+	snull_emu_update(&priv->emu);					\
+	return count;							\
+}									\
+static DEVICE_ATTR_RW(field)
+
+SNULL_EMU_ATTR(latency_us);
+SNULL_EMU_ATTR(jitter_us);
+SNULL_EMU_ATTR(rate_kbit);
+SNULL_EMU_ATTR(loss_ppm);
+SNULL_EMU_ATTR(reorder_ppm);
+SNULL_EMU_ATTR(limit);
+
+static struct attribute *snull_emu_attrs[] = {
+	&dev_attr_latency_us.attr,
+	&dev_attr_jitter_us.attr,
+	&dev_attr_rate_kbit.attr,
+	&dev_attr_loss_ppm.attr,
+	&dev_attr_reorder_ppm.attr,
+	&dev_attr_limit.attr,
+	NULL,
+};
+
+static const struct attribute_group snull_emu_group = {
+	.name = "snull",
+	.attrs = snull_emu_attrs,
+};
+
+/*
+ * Transmit a packet (low level interface)
+ */
+static void snull_hw_tx(char *buf, int len, struct net_device *dev,
+		struct snull_packet *tx_buffer, int qid)
+{
+	/*
+	 * This function deals with hw details. This interface loops
+	 * back the packet to the other snull interface (if any).
+	 * In other words, this function implements the snull behaviour,
+	 * while all other procedures are rather device-independent
+	 */
+	struct snull_priv *priv;
+	struct snull_queue *q;
+    
+	/* I am paranoid. Ain't I? */
+	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
+		printk("snull: Hmm... packet too short (%i octets)\n",
+				len);
+		snull_release_buffer(tx_buffer);
+		return;
+	}
+
+	if (0) { /* enable this conditional to look at the data */
+		int i;
+		PDEBUG("len is %i\n" KERN_DEBUG "data:",len);
+		for (i=14 ; i<len; i++)
+			printk(" %02x",buf[i]&0xff);
+		printk("\n");
+	}
+	/*
+	 * Ethhdr is 14 bytes, but the kernel arranges for iphdr
+	 * to be aligned (i.e., ethhdr is unaligned)
+	 */
+	if (nr_devs == 2)
+		snull_rewrite_ip(dev, (struct iphdr *)(buf+sizeof(struct ethhdr)));
+
+	/*
+	 * Ok, now the packet is ready for transmission: first put it on
+	 * the link to the same queue of the twin device, then simulate
+	 * a transmission-done on the transmitting queue
+	 */
+	tx_buffer->datalen = len;
+	snull_emulate(dev, qid, tx_buffer, len);
+
+	priv = netdev_priv(dev);
+	q = priv->queues + qid;
+	if (lockup && (++q->tx_count % lockup) == 0) {
+        	/* Simulate a dropped transmit interrupt */
+		q->tx_lockup = 1;
+		q->tx_lockups++;
+		netif_tx_stop_queue(netdev_get_tx_queue(dev, qid));
+		PDEBUG("Simulate lockup at %ld, queue %d, txp %ld\n", jiffies,
+				qid, q->tx_count);
+	}
+	else
+		snull_coalesce(&q->tx_coal, priv->tx_usecs, priv->tx_frames);
+}
+
+/*
+ * Transmit in zero-copy mode: rewrite the headers in the skb itself
+ * and queue it on the twin, which passes it up as it is.  There is no
+ * buffer to give back, so no transmit interrupt either.
+ */
+static int snull_tx_zerocopy(struct sk_buff *skb, struct net_device *dev, int qid)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = priv->queues + qid;
+	unsigned int len = skb->len;
+
+	/* The IP header must be linear, and ours to change */
+	if (!pskb_may_pull(skb, sizeof(struct ethhdr) + sizeof(struct iphdr)) ||
+	    skb_cow_head(skb, 0)) {
+		q->tx_dropped++;
+		atomic_long_inc(&dev->tx_dropped);
+		dev_kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+	trans_start = jiffies; /* save the timestamp */
+	if (nr_devs == 2)
+		snull_rewrite_ip(dev, (struct iphdr *)(skb->data + sizeof(struct ethhdr)));
+
+	/* The socket is done with it; the rest is scrubbed on delivery */
+	skb_orphan(skb);
+
+	snull_count(dev, 0, 1, len);
+	snull_emulate(dev, qid, skb, len);
+	return NETDEV_TX_OK;
+}
+
+/*
+ * Transmit a packet (called by the kernel)
+ */
+int snull_tx(struct sk_buff *skb, struct net_device *dev)
+{
+	int len;
+	unsigned long flags;
+	struct snull_priv *priv = netdev_priv(dev);
+	int qid = skb_get_queue_mapping(skb);
+	struct snull_packet *tx_buffer;
+
+	if (zerocopy)
+		return snull_tx_zerocopy(skb, dev, qid);
+
+	/* Still waiting for a lost transmit interrupt on this queue */
+	if (priv->queues[qid].tx_lockup) {
+		netif_tx_stop_queue(netdev_get_tx_queue(dev, qid));
+		return NETDEV_TX_BUSY;
+	}
+
+	/* Take the buffer first: the packet is untouched if we can't send */
+	tx_buffer = snull_get_tx_buffer(dev, qid);
+	if (tx_buffer == NULL) {
+		netif_tx_stop_queue(netdev_get_tx_queue(dev, qid));
+		return NETDEV_TX_BUSY;
+	}
+	
+	len = skb->len;
+	if (len > ETH_HLEN + max_mtu) {
+		/* GSO is done by the stack, so only odd senders get here */
+		snull_release_buffer(tx_buffer);
+		priv->queues[qid].tx_dropped++;
+		atomic_long_inc(&dev->tx_dropped);
+		dev_kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+	/*
+	 * "DMA" the frame into the buffer, fragments and all, padding it
+	 * to the minimum length.  The headers are rewritten in the copy,
+	 * so a cloned skb is never touched.
+	 */
+	skb_copy_bits(skb, 0, tx_buffer->data, len);
+	if (len < ETH_ZLEN) {
+		memset(tx_buffer->data + len, 0, ETH_ZLEN - len);
+		len = ETH_ZLEN;
+	}
+	trans_start = jiffies; /* save the timestamp */
+
+	/* Remember the skb, so we can free it at interrupt time */
+	spin_lock_irqsave(&priv->queues[qid].lock, flags);
+	__skb_queue_tail(&priv->queues[qid].tx_done, skb);
+	spin_unlock_irqrestore(&priv->queues[qid].lock, flags);
+
+	/* actual deliver of data is device-specific, and not shown here */
+	snull_hw_tx(tx_buffer->data, len, dev, tx_buffer, qid);
+
+	return 0; /* Our simple device can not fail */
+}
+
+/*
+ * Deal with a transmit timeout.
+ */
+void snull_tx_timeout (struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
 
 	PDEBUG("Transmit timeout at %ld, latency %ld\n", jiffies,
 			jiffies - trans_start);
-        /* Simulate a transmission interrupt to get things moving */
-	priv->status = SNULL_TX_INTR;
-	snull_interrupt(0, dev, NULL);
-	priv->stats.tx_errors++;
-	netif_wake_queue(dev);
+        /* Simulate a transmission interrupt on stuck queues to get things moving */
+	for (i = 0; i < priv->nqueues; i++) {
+		if (!priv->queues[i].tx_lockup)
+			continue;
+		priv->queues[i].tx_lockup = 0;
+		snull_fire(&priv->queues[i].tx_coal);
+		priv->queues[i].tx_timeouts++;
+		netif_tx_wake_queue(netdev_get_tx_queue(dev, i));
+	}
 	return;
 }
 
+#ifdef SNULL_XDP
+/*
+ * XDP.  The program runs on the pool buffer itself, from the NAPI
+ * poll only: redirection keeps per-CPU state that a hard irq handler
+ * could trample.  XDP_TX puts the very same buffer back on the wire;
+ * a redirected frame outlives our rings, and the memory model of the
+ * queue says it is given back with put_page(), so it is first copied
+ * to a page of its own.
+ */
+
+/*
+ * Put a frame on the wire from XDP: like snull_hw_tx, but there is no
+ * skb to complete, hence no transmit interrupt and no lockup.
+ */
+static int snull_xdp_hw_tx(struct net_device *dev, int qid,
+		struct snull_packet *pkt)
+{
+	if (pkt->datalen < sizeof(struct ethhdr) + sizeof(struct iphdr))
+		return -EINVAL;
+	if (nr_devs == 2)
+		snull_rewrite_ip(dev, (struct iphdr *)(pkt->data + sizeof(struct ethhdr)));
+	snull_count(dev, 0, 1, pkt->datalen);
+	snull_emulate(dev, qid, pkt, pkt->datalen);
+	return 0;
+}
+
+static int snull_xdp_redirect(struct net_device *dev, struct bpf_prog *prog,
+		struct xdp_buff *xdp)
+{
+	struct page *page = dev_alloc_page();
+	void *start, *va;
+	int err;
+
+	if (!page)
+		return -ENOMEM;
+	/* Same layout in the page, metadata included if there is any */
+	va = page_address(page);
+	start = min(xdp->data_meta, xdp->data);
+	memcpy(va + (start - xdp->data_hard_start), start,
+			xdp->data_end - start);
+	xdp->data_meta = va + (xdp->data_meta - xdp->data_hard_start);
+	xdp->data = va + (xdp->data - xdp->data_hard_start);
+	xdp->data_end = va + (xdp->data_end - xdp->data_hard_start);
+	xdp->data_hard_start = va;
+
+	err = xdp_do_redirect(dev, xdp, prog);
+	if (err)
+		put_page(page);
+	return err;
+}
+
+/*
+ * Run the program on a received packet.  Unless the verdict is
+ * XDP_PASS, the packet is gone when this returns.
+ */
+static u32 snull_run_xdp(struct net_device *dev, int qid,
+		struct snull_packet *pkt)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = priv->queues + qid;
+	int len = pkt->datalen;
+	struct bpf_prog *prog;
+	struct xdp_buff xdp;
+	u32 act = XDP_PASS;
+
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+	if (!prog)
+		goto out;
+	xdp.data_hard_start = pkt->buf;
+#ifdef SNULL_XSK
+	if (pkt->xsk)	/* an AF_XDP frame lends us no headroom */
+		xdp.data_hard_start = pkt->data;
+#endif
+	xdp.data = pkt->data;
+	xdp.data_end = pkt->data + pkt->datalen;
+	xdp_set_data_meta_invalid(&xdp);
+	xdp.rxq = &q->xdp_rxq;
+
+	act = bpf_prog_run_xdp(prog, &xdp);
+
+	/* Either end of the frame may have moved */
+	pkt->data = xdp.data;
+	pkt->datalen = xdp.data_end - xdp.data;
+	switch (act) {
+	case XDP_PASS:
+		goto out;
+	case XDP_TX:
+		if (snull_xdp_hw_tx(dev, qid, pkt))
+			goto drop;
+		q->xdp_tx++;
+		break;
+	case XDP_REDIRECT:
+		if (snull_xdp_redirect(dev, prog, &xdp))
+			goto drop;
+		q->xdp_redirects++;
+		q->xdp_flush = 1;
+		snull_release_buffer(pkt);
+		break;
+	default:
+		bpf_warn_invalid_xdp_action(act);
+		/* fall through */
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		/* fall through */
+	case XDP_DROP:
+	  drop:
+		q->xdp_drops++;
+		snull_release_buffer(pkt);
+		break;
+	}
+	snull_count(dev, 1, 1, len);
+  out:
+	rcu_read_unlock();
+	return act;
+}
+
+/*
+ * Frames redirected to us by somebody else's XDP program: copy them
+ * to pool buffers and send them like XDP_TX does.  Zero-copy mode
+ * hands sk_buffs to the wire, not pool buffers, so it takes none.
+ * Every frame is ours to free, sent or not.
+ */
+static int snull_xdp_xmit(struct net_device *dev, int n,
+		struct xdp_frame **frames, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int qid = smp_processor_id() % priv->nqueues;
+	struct snull_packet *pkt;
+	int i, drops = 0;
+
+	if (flags & ~XDP_XMIT_FLAGS_MASK)
+		return -EINVAL;
+	if (zerocopy)
+		return -EOPNOTSUPP;
+	if (!netif_running(dev))
+		return -ENETDOWN;
+
+	for (i = 0; i < n; i++) {
+		pkt = NULL;
+		if (frames[i]->len <= ETH_HLEN + max_mtu)
+			pkt = snull_get_tx_buffer(dev, qid);
+		if (pkt) {
+			memcpy(pkt->data, frames[i]->data, frames[i]->len);
+			pkt->datalen = frames[i]->len;
+			if (snull_xdp_hw_tx(dev, qid, pkt)) {
+				snull_release_buffer(pkt);
+				pkt = NULL;
+			}
+		}
+		if (!pkt) {
+			priv->queues[qid].tx_dropped++;
+			atomic_long_inc(&dev->tx_dropped);
+			drops++;
+		}
+		xdp_return_frame_rx_napi(frames[i]);
+	}
+	return n - drops;
+}
+
+static int snull_xdp_setup(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	if (zerocopy || !use_napi) {
+		NL_SET_ERR_MSG(bpf->extack, "snull: XDP needs use_napi=1 and zerocopy=0");
+		return -EOPNOTSUPP;
+	}
+	/* Redirected frames must fit a page, with room for an skb after */
+	if (SNULL_HEADROOM + ETH_HLEN + max_mtu >
+	    PAGE_SIZE - SKB_DATA_ALIGN(sizeof(struct skb_shared_info))) {
+		NL_SET_ERR_MSG(bpf->extack, "snull: max_mtu too large for XDP");
+		return -EOPNOTSUPP;
+	}
+	old = rtnl_dereference(priv->xdp_prog);
+	rcu_assign_pointer(priv->xdp_prog, bpf->prog);
+	if (old)
+		bpf_prog_put(old);
+	return 0;
+}
+
+static int snull_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct bpf_prog *prog;
+
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return snull_xdp_setup(dev, bpf);
+	case XDP_QUERY_PROG:
+		prog = rtnl_dereference(priv->xdp_prog);
+		bpf->prog_id = prog ? prog->aux->id : 0;
+		return 0;
+#ifdef SNULL_XSK
+	case XDP_SETUP_XSK_UMEM:
+		return snull_xsk_setup(dev, bpf->xsk.umem, bpf->xsk.queue_id);
+#endif
+	default:
+		return -EINVAL;
+	}
+}
+#endif /* SNULL_XDP */
+
+#ifdef SNULL_XSK
+/*
+ * AF_XDP zero-copy.  A queue with a socket bound sends the frames of
+ * its TX ring as they are: a pool packet serves as the descriptor,
+ * its data pointing into the UMEM instead of its own buffer, so the
+ * pool size, and SNULL_XSK_MAX, bound the frames in flight.  Whoever
+ * releases the packet on the other side makes the frame complete, and
+ * the poll hands completions back to the socket.  Reception needs no help from us:
+ * XDP_REDIRECT to the socket copies the frame into its UMEM.
+ */
+
+/*
+ * The completion ring hands addresses back in the order the frames
+ * were taken from the TX ring, not the order they come back in: the
+ * emulated link loses and reorders them, and behind the switch they
+ * go to different receivers.  Complete only up to the oldest frame
+ * still out, or the socket could reuse one we are still sending.
+ */
+static void snull_xsk_complete(struct snull_queue *q)
+{
+	u8 *fin;
+	int done = 0;
+
+	while (q->xsk_tail != q->xsk_seq) {
+		fin = &q->xsk_fin[q->xsk_tail & (SNULL_XSK_MAX - 1)];
+		if (!smp_load_acquire(fin))
+			break;
+		*fin = 0;
+		q->xsk_tail++;
+		done++;
+	}
+	if (done)
+		xsk_umem_complete_tx(q->umem, done);
+}
+
+static int snull_xsk_tx(struct snull_queue *q, int budget)
+{
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	int qid = q - priv->queues;
+	struct xdp_umem *umem = q->umem;
+	struct snull_packet *pkt;
+	struct xdp_desc desc;
+	int sent = 0;
+
+	snull_xsk_complete(q);
+	/* A full window waits for the oldest frame: its release polls us */
+	while (sent < budget && q->xsk_seq - q->xsk_tail < SNULL_XSK_MAX) {
+		pkt = snull_get_tx_buffer(dev, qid);
+		if (!pkt)
+			break;
+		if (!xsk_umem_consume_tx(umem, &desc)) {
+			snull_release_buffer(pkt);
+			break;
+		}
+		pkt->data = (u8 *)xdp_umem_get_data(umem, desc.addr);
+		pkt->datalen = desc.len;
+		pkt->xsk = q;
+		pkt->xsk_seq = q->xsk_seq++;
+		atomic_inc(&q->xsk_inflight);
+		/* Too long for the wire: dropped, but still completed */
+		if (desc.len > ETH_HLEN + max_mtu ||
+		    snull_xdp_hw_tx(dev, qid, pkt)) {
+			q->tx_dropped++;
+			atomic_long_inc(&dev->tx_dropped);
+			snull_release_buffer(pkt);
+		}
+		sent++;
+	}
+	if (sent) {
+		q->xsk_tx += sent;
+		xsk_umem_consume_tx_done(umem);
+	}
+	if (xsk_umem_uses_need_wakeup(umem))
+		xsk_set_tx_need_wakeup(umem);
+	return sent == budget;
+}
+
+/*
+ * Like a NIC resetting a queue pair: what XDP_TX bounced back to our
+ * own ring is lost, and we wait for the receivers to let go of the
+ * frames they are looking at.  Their traffic is none of our business,
+ * except on an interface that is down: nobody polls its ring before
+ * the next open, so whatever waits there is dropped.
+ * Called with the NAPI context of the queue disabled.
+ */
+static void snull_xsk_flush(struct net_device *dev, int qid)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = priv->queues + qid;
+	struct net_device *peer;
+	void *entry;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < nr_devs; i++) {
+			peer = snull_devs[i];
+			if (peer != dev && netif_running(peer))
+				continue;
+			while ((entry = snull_dequeue(peer, qid)))
+				snull_release_buffer(entry);
+		}
+		if (!atomic_read(&q->xsk_inflight))
+			break;
+		msleep(1);
+	}
+	snull_xsk_complete(q);	/* all of them, now */
+}
+
+static int snull_xsk_setup(struct net_device *dev, struct xdp_umem *umem,
+		u16 qid)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int running = netif_running(dev);
+	struct snull_queue *q;
+
+	if (qid >= priv->nqueues)
+		return -EINVAL;
+	q = priv->queues + qid;
+	if (umem && (zerocopy || !use_napi))
+		return -EOPNOTSUPP;
+	if (umem && q->umem)
+		return -EBUSY;
+
+	if (running)
+		napi_disable(&q->napi);
+	if (q->umem)
+		snull_xsk_flush(dev, qid);
+	q->umem = umem;
+	if (running)
+		napi_enable(&q->napi);
+	return 0;
+}
+
+static int snull_xsk_wakeup(struct net_device *dev, u32 qid, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (!netif_running(dev))
+		return -ENETDOWN;
+	if (qid >= priv->nqueues || !priv->queues[qid].umem)
+		return -ENXIO;
+	local_bh_disable();	/* so that the poll runs right away */
+	napi_schedule(&priv->queues[qid].napi);
+	local_bh_enable();
+	return 0;
+}
+#endif /* SNULL_XSK */
+
+
 
 
 /*
@@ -564,12 +2006,42 @@ int snull_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
 }
 
 /*
- * Return statistics to the caller
+ * Return statistics to the caller, summed up over the CPUs.  The
+ * drops are counted in the net_device itself, and added by the core.
  */
-struct net_device_stats *snull_stats(struct net_device *dev)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+static void snull_get_stats64(struct net_device *dev,
+		struct rtnl_link_stats64 *stats)
+#else
+static struct rtnl_link_stats64 *snull_get_stats64(struct net_device *dev,
+		struct rtnl_link_stats64 *stats)
+#endif
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	return &priv->stats;
+	struct pcpu_sw_netstats *pcpu;
+	u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+	unsigned int start;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(priv->tstats, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&pcpu->syncp);
+			rx_packets = pcpu->rx_packets;
+			rx_bytes = pcpu->rx_bytes;
+			tx_packets = pcpu->tx_packets;
+			tx_bytes = pcpu->tx_bytes;
+		} while (u64_stats_fetch_retry_irq(&pcpu->syncp, start));
+		stats->rx_packets += rx_packets;
+		stats->rx_bytes += rx_bytes;
+		stats->tx_packets += tx_packets;
+		stats->tx_bytes += tx_bytes;
+	}
+	for (i = 0; i < priv->nqueues; i++)
+		stats->tx_errors += priv->queues[i].tx_timeouts;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
+	return stats;
+#endif
 }
 
 /*
@@ -611,19 +2083,14 @@ int snull_header(struct sk_buff *skb, struct net_device *dev,
  */
 int snull_change_mtu(struct net_device *dev, int new_mtu)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
-	spinlock_t *lock = &priv->lock;
-    
-	/* check ranges */
-	if ((new_mtu < 68) || (new_mtu > 1500))
+	/* check ranges: the copy mode can't go beyond its buffers */
+	if ((new_mtu < 68) || (new_mtu > (zerocopy ? SNULL_MAX_MTU : max_mtu)))
 		return -EINVAL;
 	/*
-	 * Do anything you need, and the accept the value
+	 * Do anything you need, and the accept the value; we are called
+	 * under the rtnl lock, which is all the locking we need.
 	 */
-	spin_lock_irqsave(lock, flags);
 	dev->mtu = new_mtu;
-	spin_unlock_irqrestore(lock, flags);
 	return 0; /* success */
 }
 
@@ -632,15 +2099,142 @@ static const struct header_ops snull_header_ops = {
 	/*.rebuild = snull_rebuild_header*/
 };
 
+/*
+ * Ethtool statistics: the state of each receive ring, and the reasons
+ * each queue pair dropped or held back packets.
+ */
+static const char snull_queue_stats[][ETH_GSTRING_LEN] = {
+	"rx%d_occupancy", "rx%d_full", "rx%d_ring_drops", "rx%d_nomem_drops",
+	"tx%d_pool_empty", "tx%d_lockups", "tx%d_timeouts", "tx%d_drops",
+	"tx%d_emu_backlog", "tx%d_emu_lost", "tx%d_emu_reordered",
+	"tx%d_emu_overlimit",
+#ifdef SNULL_XDP
+	"rx%d_xdp_drops", "rx%d_xdp_tx", "rx%d_xdp_redirects",
+#endif
+#ifdef SNULL_XSK
+	"tx%d_xsk_frames",
+#endif
+};
+#define SNULL_QUEUE_STATS ARRAY_SIZE(snull_queue_stats)
+
+static void snull_get_drvinfo(struct net_device *dev,
+		struct ethtool_drvinfo *info)
+{
+	strlcpy(info->driver, "snull", sizeof(info->driver));
+}
+
+static int snull_get_sset_count(struct net_device *dev, int sset)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+	return priv->nqueues * SNULL_QUEUE_STATS;
+}
+
+static void snull_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, j;
+
+	if (sset != ETH_SS_STATS)
+		return;
+	for (i = 0; i < priv->nqueues; i++)
+		for (j = 0; j < SNULL_QUEUE_STATS; j++) {
+			snprintf(data, ETH_GSTRING_LEN, snull_queue_stats[j], i);
+			data += ETH_GSTRING_LEN;
+		}
+}
+
+static void snull_get_ethtool_stats(struct net_device *dev,
+		struct ethtool_stats *stats, u64 *data)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	int i;
+
+	for (i = 0; i < priv->nqueues; i++) {
+		q = priv->queues + i;
+		*data++ = q->head - q->tail;
+		*data++ = q->ring_full;
+		*data++ = q->ring_drops;
+		*data++ = q->rx_nomem;
+		*data++ = q->tx_pool_empty;
+		*data++ = q->tx_lockups;
+		*data++ = q->tx_timeouts;
+		*data++ = q->tx_dropped;
+		*data++ = q->wheel ? q->wheel->count : 0;
+		*data++ = q->wheel ? q->wheel->lost : 0;
+		*data++ = q->wheel ? q->wheel->reordered : 0;
+		*data++ = q->wheel ? q->wheel->overlimit : 0;
+#ifdef SNULL_XDP
+		*data++ = q->xdp_drops;
+		*data++ = q->xdp_tx;
+		*data++ = q->xdp_redirects;
+#endif
+#ifdef SNULL_XSK
+		*data++ = q->xsk_tx;
+#endif
+	}
+}
+
+/*
+ * Interrupt coalescing.  A frame count of 0 or 1 means an interrupt
+ * per event; the count can't go beyond what a ring holds.
+ */
+static int snull_get_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ec->rx_coalesce_usecs = priv->rx_usecs;
+	ec->rx_max_coalesced_frames = priv->rx_frames;
+	ec->tx_coalesce_usecs = priv->tx_usecs;
+	ec->tx_max_coalesced_frames = priv->tx_frames;
+	return 0;
+}
+
+static int snull_set_coalesce(struct net_device *dev,
+		struct ethtool_coalesce *ec)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (ec->rx_max_coalesced_frames > ring_size ||
+	    ec->tx_max_coalesced_frames > ring_size)
+		return -EINVAL;
+	priv->rx_usecs = ec->rx_coalesce_usecs;
+	priv->rx_frames = max(ec->rx_max_coalesced_frames, 1U);
+	priv->tx_usecs = ec->tx_coalesce_usecs;
+	priv->tx_frames = max(ec->tx_max_coalesced_frames, 1U);
+	return 0;
+}
+
+static const struct ethtool_ops snull_ethtool_ops = {
+	.get_drvinfo		= snull_get_drvinfo,
+	.get_link		= ethtool_op_get_link,
+	.get_sset_count		= snull_get_sset_count,
+	.get_strings		= snull_get_strings,
+	.get_ethtool_stats	= snull_get_ethtool_stats,
+	.get_coalesce		= snull_get_coalesce,
+	.set_coalesce		= snull_set_coalesce,
+};
+
 static const struct net_device_ops snull_netdev_ops = {
 	.ndo_open            = snull_open,
 	.ndo_stop            = snull_release,
 	.ndo_start_xmit      = snull_tx,
 	.ndo_do_ioctl        = snull_ioctl,
 	.ndo_set_config      = snull_config,
-	.ndo_get_stats       = snull_stats,
+	.ndo_get_stats64     = snull_get_stats64,
 	.ndo_change_mtu      = snull_change_mtu,
-	.ndo_tx_timeout      = snull_tx_timeout
+	.ndo_tx_timeout      = snull_tx_timeout,
+#ifdef SNULL_XDP
+	.ndo_bpf             = snull_bpf,
+	.ndo_xdp_xmit        = snull_xdp_xmit,
+#endif
+#ifdef SNULL_XSK
+	.ndo_xsk_wakeup      = snull_xsk_wakeup,
+#endif
 };
 
 /*
@@ -650,6 +2244,8 @@ static const struct net_device_ops snull_netdev_ops = {
 void snull_init(struct net_device *dev)
 {
 	struct snull_priv *priv;
+	struct snull_queue *q;
+	int i;
 #if 0
     	/*
 	 * Make the usual checks: check_region(), probe irq, ...  -ENODEV
@@ -665,31 +2261,74 @@ void snull_init(struct net_device *dev)
 	ether_setup(dev); /* assign some of the fields */
 	dev->watchdog_timeo = timeout;
 	dev->netdev_ops = &snull_netdev_ops;
-	dev->header_ops = &snull_header_ops;
-	/* keep the default flags, just add NOARP */
-	dev->flags           |= IFF_NOARP; //withou ARP capabilities
+	dev->ethtool_ops = &snull_ethtool_ops;
+	/* The twins keep the default flags, just add NOARP; a switch needs ARP */
+	if (nr_devs == 2) {
+		dev->header_ops = &snull_header_ops;
+		dev->flags           |= IFF_NOARP; //withou ARP capabilities
+	}
 	dev->features        |= NETIF_F_HW_CSUM;//hardware does checksumming itself
+	/*
+	 * Scatter/gather lets the stack hand us big multi-page skbs,
+	 * which it segments for us (GSO) when we can't take them whole.
+	 * In zero-copy mode we can: a TSO skb goes to the twin as one
+	 * packet, and never gets cut up at all.
+	 */
+	dev->features        |= NETIF_F_SG;
+	if (zerocopy)
+		dev->features |= NETIF_F_TSO | NETIF_F_TSO_ECN;
+	dev->hw_features     |= dev->features;
+	/* a shared skb can't be handed over to the twin */
+	if (zerocopy)
+		dev->priv_flags &= ~IFF_TX_SKB_SHARING;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	/* the core checks these before snull_change_mtu is even called */
+	dev->min_mtu = 68;
+	dev->max_mtu = zerocopy ? SNULL_MAX_MTU : max_mtu;
+#endif
 
 	/*
 	 * Then, initialize the priv field. This encloses the statistics
 	 * and a few private fields.
 	 */
 	priv = netdev_priv(dev);
-	if (use_napi) {
-                /*把网络设备dev与napi绑定,一次轮询最大处理的报文数为2 */
-		netif_napi_add(dev, &priv->napi, snull_poll,2);
+	memset(priv, 0, sizeof(struct snull_priv) +
+			nr_queues * sizeof(struct snull_queue));
+	priv->dev = dev;
+	priv->nqueues = nr_queues;
+	priv->rx_frames = priv->tx_frames = 1;	/* No coalescing */
+	priv->emu.latency_us = emu_latency_us;
+	priv->emu.jitter_us = emu_jitter_us;
+	priv->emu.rate_kbit = emu_rate_kbit;
+	priv->emu.loss_ppm = emu_loss_ppm;
+	priv->emu.reorder_ppm = emu_reorder_ppm;
+	priv->emu.limit = emu_limit;
+	snull_emu_update(&priv->emu);
+	dev->sysfs_groups[0] = &snull_emu_group;
+	for (i = 0; i < nr_queues; i++) {
+		q = priv->queues + i;
+		spin_lock_init(&q->lock);
+		q->dev = dev;
+		skb_queue_head_init(&q->tx_done);
+		snull_setup_coal(q, &q->rx_coal, SNULL_RX_INTR);
+		snull_setup_coal(q, &q->tx_coal, SNULL_TX_INTR);
+		if (use_napi) {
+			/*把网络设备dev与napi绑定,一次轮询最多处理napi_weight个报文 */
+			netif_napi_add(dev, &q->napi, snull_poll, napi_weight);
+		}
+		snull_rx_ints(dev, i, 1);	/* enable receive interrupts */
 	}
-	memset(priv, 0, sizeof(struct snull_priv));
-	spin_lock_init(&priv->lock);
-	snull_rx_ints(dev, 1);		/* enable receive interrupts */
+	snull_setup_rings(dev);
+	snull_setup_wheels(dev);
 	snull_setup_pool(dev);
+	priv->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
 }
 
 /*
  * The devices
  */
 
-struct net_device *snull_devs[2];
+struct net_device **snull_devs;
 
 
 
@@ -699,15 +2338,59 @@ struct net_device *snull_devs[2];
 
 void snull_cleanup(void)
 {
-	int i;
+	struct snull_priv *priv;
+	int i, q;
     
-	for (i = 0; i < 2;  i++) {
-		if (snull_devs[i]) {
+	if (snull_devs == NULL)
+		return;
+	/* All down first: any one can still send to the others */
+	for (i = 0; i < nr_devs;  i++)
+		if (snull_devs[i] && snull_devs[i]->reg_state == NETREG_REGISTERED)
 			unregister_netdev(snull_devs[i]);
+	for (i = 0; i < nr_devs;  i++)
+		if (snull_devs[i])
+			snull_teardown_wheels(snull_devs[i]);
+	/*
+	 * Now nothing can raise an interrupt any more; but a device that
+	 * was still up, or a wheel, may have armed a stopped one's
+	 * coalescing timers after snull_release cancelled them.
+	 */
+	for (i = 0; i < nr_devs;  i++) {
+		if (snull_devs[i] == NULL)
+			continue;
+		priv = netdev_priv(snull_devs[i]);
+		for (q = 0; q < priv->nqueues; q++) {
+			hrtimer_cancel(&priv->queues[q].rx_coal.timer);
+			hrtimer_cancel(&priv->queues[q].tx_coal.timer);
+		}
+	}
+	/*
+	 * A ring holds packets from the pools of the other devices, so
+	 * every ring is drained before any pool goes, and every pool
+	 * before any netdev.
+	 */
+	for (i = 0; i < nr_devs;  i++)
+		if (snull_devs[i])
+			snull_teardown_rings(snull_devs[i]);
+	for (i = 0; i < nr_devs;  i++)
+		if (snull_devs[i])
 			snull_teardown_pool(snull_devs[i]);
+	for (i = 0; i < nr_devs;  i++) {
+		if (snull_devs[i]) {
+			priv = netdev_priv(snull_devs[i]);
+			free_percpu(priv->tstats);
+#ifdef SNULL_XDP
+			if (rcu_access_pointer(priv->xdp_prog))
+				bpf_prog_put(rcu_dereference_protected(
+						priv->xdp_prog, 1));
+#endif
 			free_netdev(snull_devs[i]);
 		}
 	}
+	cancel_delayed_work_sync(&snull_fdb_work);
+	snull_fdb_flush(1);
+	kfree(snull_devs);
+	snull_devs = NULL;
 	return;
 }
 
@@ -716,25 +2399,41 @@ void snull_cleanup(void)
 
 int snull_init_module(void)
 {
+	struct snull_priv *priv;
 	int result, i, ret = -ENOMEM;
 
 	snull_interrupt = use_napi ? snull_napi_interrupt : snull_regular_interrupt;
-
-	/* Allocate the devices */
-	snull_devs[0] = alloc_netdev(sizeof(struct snull_priv), "sn%d", NET_NAME_UNKNOWN,
-			snull_init);
-	snull_devs[1] = alloc_netdev(sizeof(struct snull_priv), "sn%d", NET_NAME_UNKNOWN,
-			snull_init);
-	if (snull_devs[0] == NULL || snull_devs[1] == NULL)
-		goto out;
+	if (nr_queues <= 0)
+		nr_queues = num_online_cpus();
+	max_mtu = clamp(max_mtu, 68, SNULL_MAX_MTU);
+	ring_size = roundup_pow_of_two(max(ring_size, 2));
+	nr_devs = max(nr_devs, 2);
+	INIT_DELAYED_WORK(&snull_fdb_work, snull_fdb_age);
+
+	snull_devs = kcalloc(nr_devs, sizeof(*snull_devs), GFP_KERNEL);
+	if (snull_devs == NULL)
+		return -ENOMEM;
+	/* Allocate the devices, with their queues after the private data */
+	for (i = 0; i < nr_devs; i++) {
+		snull_devs[i] = alloc_netdev_mqs(sizeof(struct snull_priv) +
+				nr_queues * sizeof(struct snull_queue),
+				"sn%d", NET_NAME_UNKNOWN, snull_init,
+				nr_queues, nr_queues);
+		if (snull_devs[i] == NULL)
+			goto out;
+		priv = netdev_priv(snull_devs[i]);
+		priv->port = i;
+	}
 
 	ret = -ENODEV;
-	for (i = 0; i < 2;  i++)
+	for (i = 0; i < nr_devs;  i++)
 		if ((result = register_netdev(snull_devs[i])))
 			printk("snull: error %i registering device \"%s\"\n",
 					result, snull_devs[i]->name);
 		else
 			ret = 0;
+	if (nr_devs > 2)
+		schedule_delayed_work(&snull_fdb_work, SNULL_FDB_AGE / 10);
    out:
 	if (ret) 
 		snull_cleanup();